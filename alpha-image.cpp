@@ -1,12 +1,14 @@
 #include "alpha-image.h"
 
+#include <algorithm>
 #include <iostream>
 
 #include "opencv2/highgui/highgui.hpp"
 
 AlphaImage::AlphaImage(std::string filename, double to_face_scale, double to_face_offset)
                       : mToFaceWidthScale(to_face_scale),
-                        mToFaceOffset(to_face_offset)
+                        mToFaceOffset(to_face_offset),
+                        mCache(new SpriteCache(DEFAULT_CACHE_BUDGET))
 {
   cv::Mat image = cv::imread(filename, cv::IMREAD_UNCHANGED);
   mColor = cv::Mat(image.rows, image.cols, CV_8UC3);
@@ -46,16 +48,33 @@ int AlphaImage::offset(int face_width) const
   return width(face_width) / mToFaceOffset;
 }
 
-void AlphaImage::write_scaled(cv::Mat &color, cv::Mat &alpha, cv::Rect targetROI) const
+Sprite AlphaImage::scaled(int width) const
 {
-  cv::Mat scaled_color, scaled_alpha;
-  cv::Size scaled_size(targetROI.width, targetROI.height);
-  cv::Rect roi(cv::Point(0, 0), scaled_size);
+  Sprite sprite;
+  if (mCache->get(width, sprite)) {
+    return sprite;
+  }
+
+  cv::Size scaled_size(width, std::max(1, cvRound(width / mRatio)));
+  cv::resize(mColor, sprite.color, scaled_size, 1.0, 1.0, cv::INTER_CUBIC);
+  cv::resize(mAlpha, sprite.alpha, scaled_size, 1.0, 1.0, cv::INTER_CUBIC);
 
-  //scale image
-  cv::resize(mColor, scaled_color, scaled_size, 1.0, 1.0, cv::INTER_CUBIC);
-  cv::resize(mAlpha, scaled_alpha, scaled_size, 1.0, 1.0, cv::INTER_CUBIC);
+  mCache->put(width, sprite);
+  return sprite;
+}
 
+cv::Rect AlphaImage::write_scaled(cv::Mat &color, cv::Mat &alpha, cv::Rect targetROI) const
+{
+  int width = std::max(WIDTH_QUANTUM,
+                       (targetROI.width + WIDTH_QUANTUM / 2) / WIDTH_QUANTUM * WIDTH_QUANTUM);
+  Sprite sprite = scaled(width);
+
+  // keep the bottom of the sprite where the unquantized one would end
+  targetROI.y += targetROI.height - sprite.color.rows;
+  targetROI.width = sprite.color.cols;
+  targetROI.height = sprite.color.rows;
+
+  cv::Rect roi(cv::Point(0, 0), targetROI.size());
   if (targetROI.x < 0) {
     // cut image left
     roi.x += std::abs(targetROI.x);
@@ -65,7 +84,7 @@ void AlphaImage::write_scaled(cv::Mat &color, cv::Mat &alpha, cv::Rect targetROI
   }
   if (targetROI.x >= color.cols) {
     std::cerr << "target roi is not in image: " << targetROI << std::endl;
-    return;
+    return cv::Rect();
   } else if ((targetROI.x + targetROI.width) >= color.cols) {
     // cut image right
     int overlap = (targetROI.x + targetROI.width) - color.cols;
@@ -82,7 +101,7 @@ void AlphaImage::write_scaled(cv::Mat &color, cv::Mat &alpha, cv::Rect targetROI
   }
   if (targetROI.y >= color.rows) {
     std::cerr << "target roi is not in image: " << targetROI << std::endl;
-    return;
+    return cv::Rect();
   } else if ((targetROI.y + targetROI.height) >= color.rows) {
     // cut image bottom
     int overlap = (targetROI.y + targetROI.height) - color.rows;
@@ -90,12 +109,25 @@ void AlphaImage::write_scaled(cv::Mat &color, cv::Mat &alpha, cv::Rect targetROI
     targetROI.height -= overlap;
   }
 
-  for (int x = 0; x < targetROI.width; x++) {
-    for (int y = 0; y < targetROI.height; y++) {
-      if (scaled_alpha(roi).at<uchar>(y, x) != 0) {
-        alpha(targetROI).at<uchar>(y, x) = scaled_alpha(roi).at<uchar>(y, x);
-        color(targetROI).at<cv::Vec3b>(y, x) = scaled_color(roi).at<cv::Vec3b>(y, x);
-      }
-    }
+  if ((targetROI.width <= 0) || (targetROI.height <= 0)) {
+    // completely outside of the image on the left or top
+    return cv::Rect();
   }
+
+  // transparent pixels must not erase hats written before
+  cv::Mat mask = sprite.alpha(roi);
+  sprite.color(roi).copyTo(color(targetROI), mask);
+  mask.copyTo(alpha(targetROI), mask);
+
+  return targetROI;
+}
+
+void AlphaImage::setCacheBudget(size_t bytes)
+{
+  mCache->setBudget(bytes);
+}
+
+SpriteCacheStats AlphaImage::cacheStats() const
+{
+  return mCache->stats();
 }
@@ -10,6 +10,27 @@ void AugmentedReality::addHat(std::string const &file, double width_scale, doubl
   mHats.emplace_back(file, width_scale, x_offset_scale);
 }
 
+void AugmentedReality::setSpriteCacheBudget(size_t bytes)
+{
+  for (AlphaImage &hat : mHats) {
+    hat.setCacheBudget(bytes);
+  }
+}
+
+SpriteCacheStats AugmentedReality::spriteCacheStats() const
+{
+  SpriteCacheStats total;
+  for (AlphaImage const &hat : mHats) {
+    SpriteCacheStats stats = hat.cacheStats();
+    total.hits += stats.hits;
+    total.misses += stats.misses;
+    total.evictions += stats.evictions;
+    total.entries += stats.entries;
+    total.bytes += stats.bytes;
+  }
+  return total;
+}
+
 bool AugmentedReality::ready()
 {
   return mStream.isOpened() && !mHats.empty();
@@ -19,18 +40,19 @@ void AugmentedReality::operator()()
 {
   assert(ready());
 
+  ScopedTimer timer(mLatency);
+
+  FacesSnapshot faces = mFaces->snapshot();
+
   // for the duration of resetting the overlay no other thread must use the overlay
-  std::unique_lock<std::recursive_mutex> sl(mStream.getOverlayMutex(), std::defer_lock);
-  std::unique_lock<std::mutex> fl(mFaces->getMutex(), std::defer_lock);
-  lock(sl, fl);
+  std::unique_lock<std::recursive_mutex> sl(mStream.getOverlayMutex());
 
   mStream.resetOverlay();
 
-  int hat_idx = 0;
-
-  for (cv::Rect face : mFaces->getFaces()) {
-    int idx = hat_idx++ % mHats.size();
-    AlphaImage &hat(mHats[idx]); 
+  for (Face const &f : *faces) {
+    // every face keeps its hat while it is tracked
+    cv::Rect const &face = f.rect;
+    AlphaImage &hat(mHats[f.id % mHats.size()]); 
 
     int width = hat.width(face.width);
     int x = face.x - hat.offset(face.width);
@@ -0,0 +1,660 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+#include "opencv2/objdetect.hpp"
+#include "opencv2/video.hpp"
+
+#include "augmented-reality.h"
+#include "edge-detection.h"
+#include "facedetection.h"
+#include "optical-flow.h"
+
+/*
+ * Headless benchmark: replays a recorded input through all stages of the demo and
+ * reports per stage and end to end latency percentiles as JSON. Compared against a
+ * stored baseline it fails when a run regressed.
+ */
+
+struct BenchOptions {
+  std::string input;
+  int width = 640;
+  int height = 480;
+  // paced: play back at the rate of the input, frames are dropped when the pipeline
+  // is too slow. otherwise every frame is processed as fast as possible
+  bool paced = false;
+  int max_frames = 0;
+  int warmup = 5;
+  bool cpu_flow = false;
+  bool sparse_flow = false;
+  int flow_threads = 0;
+  int detect_interval = FaceDetection<>::DEFAULT_DETECT_INTERVAL;
+  int full_scan_interval = 1;
+  int detect_threads = 1;
+  double face_scale = 1;
+  double flow_scale = 1;
+  double edge_scale = 1;
+  bool verify_edges = false;
+  bool verify_flow = false;
+  std::string face_xml = "face.xml";
+  std::string output;
+  std::string baseline;
+  double threshold = 10;
+};
+
+void usage(char const * const progname)
+{
+  std::cout << "usage:" << std::endl
+            << progname << " [OPTIONS] -i INPUT" << std::endl
+            << std::endl
+            << "Options:" << std::endl
+            << " -i, --input: Video file, image sequence pattern or directory of images to replay" << std::endl
+            << " -w, --width: Width the input is scaled to" << std::endl
+            << " -h, --height: Height the input is scaled to" << std::endl
+            << " -n, --frames: Maximum number of frames to process" << std::endl
+            << " --warmup: Number of frames at the start that are not measured (default 5)" << std::endl
+            << " --paced: Replay at the frame rate of the input and count dropped frames" << std::endl
+            << "          (default: process every frame as fast as possible)" << std::endl
+            << " --cpu-flow: Calculate the optical flow on the cpu instead of the gpu" << std::endl
+            << " --flow-threads: Number of threads of the cpu optical flow" << std::endl
+            << " --sparse-flow: Calculate the optical flow only at the visualized points" << std::endl
+            << " --detect-interval: Run the face cascade every n-th frame, track faces in between" << std::endl
+            << "                    (default " << FaceDetection<>::DEFAULT_DETECT_INTERVAL << ", 1 disables tracking)" << std::endl
+            << " --full-scan-interval: Scan the whole frame on every n-th cascade run, only around" << std::endl
+            << "                       the known faces in between (default 1)" << std::endl
+            << " --detect-threads: Number of threads the scales of the face cascade are split across" << std::endl
+            << " --face-scale, --flow-scale, --edge-scale: Scale of the frames analyzed by the stage" << std::endl
+            << "                    relative to the input size (default 1)" << std::endl
+            << " --verify-edges: Compare the edges of every frame with cv::Canny on the whole frame" << std::endl
+            << "                 (not measured, but lowers the throughput). Exit status 3 if any differ" << std::endl
+            << " --verify-flow: Compare the striped cpu optical flow of every frame with" << std::endl
+            << "                cv::calcOpticalFlowFarneback on the whole frame and report the differences" << std::endl
+            << " -x, --face-xml: XML file containing haarcascade for face detection" << std::endl
+            << " -o, --output: Write the JSON report to this file instead of stdout" << std::endl
+            << " --baseline: JSON report of an earlier run to compare against" << std::endl
+            << " --threshold: Allowed regression against the baseline in percent (default 10)" << std::endl
+            << " --help: Show this help" << std::endl
+            << std::endl
+            << "Exit status is 2 if a latency or the throughput regressed against the baseline" << std::endl;
+}
+
+// returns processed arguments
+int check_options(BenchOptions &opts, int const argc, char const * const *argv)
+{
+  int i = 1;
+  for (; i < argc; i++) {
+    std::string arg(argv[i]);
+
+    if (arg.find_first_of("-") == std::string::npos) {
+      break;
+    }
+
+    bool has_value = (i + 1) < argc;
+    std::string value = has_value ? std::string(argv[i + 1]) : std::string();
+    bool needs_value = true;
+
+    if (arg == "-i" || arg == "--input") {
+      opts.input = value;
+    } else if (arg == "-w" || arg == "--width") {
+      opts.width = atoi(value.c_str());
+    } else if (arg == "-h" || arg == "--height") {
+      opts.height = atoi(value.c_str());
+    } else if (arg == "-n" || arg == "--frames") {
+      opts.max_frames = atoi(value.c_str());
+    } else if (arg == "--warmup") {
+      opts.warmup = atoi(value.c_str());
+    } else if (arg == "--flow-threads") {
+      opts.flow_threads = atoi(value.c_str());
+    } else if (arg == "--detect-interval") {
+      opts.detect_interval = atoi(value.c_str());
+    } else if (arg == "--full-scan-interval") {
+      opts.full_scan_interval = atoi(value.c_str());
+    } else if (arg == "--detect-threads") {
+      opts.detect_threads = atoi(value.c_str());
+    } else if (arg == "--face-scale" || arg == "--flow-scale" || arg == "--edge-scale") {
+      double *scale = (arg == "--face-scale") ? &opts.face_scale
+                    : (arg == "--flow-scale") ? &opts.flow_scale : &opts.edge_scale;
+      *scale = atof(value.c_str());
+      if (has_value && ((*scale <= 0) || (*scale > 1))) {
+        std::cerr << "scale of " << arg << " has to be in (0, 1]" << std::endl;
+        return -1;
+      }
+    } else if (arg == "-x" || arg == "--face-xml") {
+      opts.face_xml = value;
+    } else if (arg == "-o" || arg == "--output") {
+      opts.output = value;
+    } else if (arg == "--baseline") {
+      opts.baseline = value;
+    } else if (arg == "--threshold") {
+      opts.threshold = atof(value.c_str());
+    } else {
+      needs_value = false;
+      if (arg == "--paced") {
+        opts.paced = true;
+      } else if (arg == "--cpu-flow") {
+        opts.cpu_flow = true;
+      } else if (arg == "--sparse-flow") {
+        opts.sparse_flow = true;
+      } else if (arg == "--verify-edges") {
+        opts.verify_edges = true;
+      } else if (arg == "--verify-flow") {
+        opts.verify_flow = true;
+      } else if (arg == "--help") {
+        return -1;
+      } else {
+        std::cerr << "unknown option: " << arg << std::endl;
+        return -1;
+      }
+    }
+
+    if (needs_value) {
+      if (!has_value) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      i++;
+    }
+  }
+
+  if (opts.input.empty()) {
+    std::cerr << "no input given" << std::endl;
+    return -1;
+  }
+
+  return i;
+}
+
+class LatencySamples {
+
+private:
+  std::vector<double> mSamples;
+
+public:
+  void add(double ms)
+  {
+    mSamples.push_back(ms);
+  }
+
+  size_t count() const
+  {
+    return mSamples.size();
+  }
+
+  // nearest rank percentile, p in [0, 100]
+  double percentile(double p) const
+  {
+    if (mSamples.empty()) {
+      return 0;
+    }
+
+    std::vector<double> sorted(mSamples);
+    std::sort(sorted.begin(), sorted.end());
+    size_t rank = (size_t) std::ceil(p / 100.0 * sorted.size());
+    return sorted[std::min(sorted.size() - 1, std::max<size_t>(rank, 1) - 1)];
+  }
+
+  double mean() const
+  {
+    if (mSamples.empty()) {
+      return 0;
+    }
+
+    double sum = 0;
+    for (double s : mSamples) {
+      sum += s;
+    }
+    return sum / mSamples.size();
+  }
+
+  double max() const
+  {
+    return mSamples.empty() ? 0 : *std::max_element(mSamples.begin(), mSamples.end());
+  }
+};
+
+// reported stages in pipeline order
+std::vector<std::string> const STAGES =
+{
+  "capture", "edges", "faces", "ar", "flow", "composite", "end_to_end"
+};
+
+struct BenchResult {
+  std::map<std::string, LatencySamples> stages;
+  uint64_t frames = 0;
+  uint64_t dropped = 0;
+  // frames whose edges differ from the reference, with --verify-edges
+  uint64_t edge_mismatches = 0;
+  // frames whose striped flow differs from the reference, with --verify-flow
+  uint64_t flow_mismatches = 0;
+  double flow_max_error = 0;
+  double duration_s = 0;
+  FaceDetection<cv::CascadeClassifier>::Stats faces = { 0, 0, 0 };
+
+  double throughput() const
+  {
+    return (duration_s > 0) ? frames / duration_s : 0;
+  }
+};
+
+inline double ms_since(double start)
+{
+  return ((double) cv::getTickCount() - start) / cv::getTickFrequency() * 1000;
+}
+
+template <typename TFlow>
+void configure_flow_backend(TFlow &backend, BenchOptions const &opts)
+{
+}
+
+template <>
+void configure_flow_backend(CpuFarnebackFlow &backend, BenchOptions const &opts)
+{
+  backend.setThreads(opts.flow_threads);
+}
+
+// difference in pixels between the striped and the full-frame flow counted as mismatch
+double const FLOW_TOLERANCE = 0.01;
+
+// largest difference in pixels between the flow of the striped cpu backend between the
+// two frames it has loaded and cv::calcOpticalFlowFarneback on the whole frame
+double flow_reference_error(CpuFarnebackFlow &striped, cv::Mat const &last, cv::Mat const &now)
+{
+  cv::Mat flowx, flowy;
+  double calc_time_ms, dl_time_ms;
+  striped.calc(flowx, flowy, calc_time_ms, dl_time_ms);
+
+  FarnebackParams const p;
+  cv::Mat reference;
+  cv::calcOpticalFlowFarneback(last, now, reference, p.pyrScale, p.numLevels, p.winSize,
+                               p.numIters, p.polyN, p.polySigma, p.flags);
+  cv::Mat parts[2];
+  cv::split(reference, parts);
+
+  return std::max(cv::norm(flowx, parts[0], cv::NORM_INF),
+                  cv::norm(flowy, parts[1], cv::NORM_INF));
+}
+
+template <typename TFlow>
+bool run_benchmark(LiveStream &stream, BenchOptions const &opts, BenchResult &result)
+{
+  Faces faces;
+  FaceDetection<cv::CascadeClassifier> facedetection(stream, faces, opts.face_xml);
+  if (!facedetection.isReady()) {
+    std::cerr << "loading FaceDetection failed" << std::endl;
+    return false;
+  }
+  facedetection.setDetectInterval(opts.detect_interval);
+  facedetection.setFullScanInterval(opts.full_scan_interval);
+  facedetection.setAnalysisScale(opts.face_scale);
+  if (!facedetection.setDetectThreads(opts.detect_threads)) {
+    return false;
+  }
+
+  AugmentedReality ar(stream, &faces);
+  ar.addHat("sombrero.png", 2, 4);
+  ar.addHat("tophat.png", 1.2, 10);
+  ar.addHat("crown.png", 1.2, 16);
+  ar.addHat("fancy.png", 2, 4);
+  if (!ar.ready()) {
+    std::cerr << "loading AugmentedReality failed" << std::endl;
+    return false;
+  }
+
+  ThreadSafeMat of_visualize(cv::Mat::zeros(stream.height(), stream.width(), CV_8UC3));
+  OpticalFlow<TFlow> of(stream, of_visualize);
+  configure_flow_backend(of.backend(), opts);
+  of.setSparse(opts.sparse_flow);
+  of.setAnalysisScale(opts.flow_scale);
+  of.setFaces(&faces);
+  if (!of.isReady()) {
+    std::cerr << "loading OpticalFlow failed" << std::endl;
+    return false;
+  }
+
+  if (opts.paced) {
+    stream.start();
+  }
+
+  // separate from the flow stage, so the reference is also checked with the gpu flow
+  CpuFarnebackFlow striped_flow(opts.flow_threads);
+  cv::Mat verify_last_gray;
+
+  cv::Mat image;
+  uint64_t last_seq = 0;
+  int processed = 0;
+  double bench_start = 0;
+
+  while ((opts.max_frames <= 0) || (processed < opts.max_frames)) {
+    FramePtr frame;
+
+    if (opts.paced) {
+      frame = stream.waitForFrame(last_seq, std::chrono::milliseconds(100));
+      if (!frame || (frame->seq == last_seq)) {
+        if (stream.finished()) {
+          break;
+        }
+        continue;
+      }
+    } else {
+      // the first frame is captured when the stream is opened
+      frame = (last_seq == 0) ? stream.getFrame() : stream.nextFrame();
+      if (!frame) {
+        break;
+      }
+    }
+
+    bool measured = processed >= opts.warmup;
+    if (processed == opts.warmup) {
+      bench_start = (double) cv::getTickCount();
+    }
+    if (measured && (last_seq != 0)) {
+      result.dropped += frame->seq - last_seq - 1;
+    }
+    last_seq = frame->seq;
+
+    double t;
+    std::map<std::string, double> times;
+    times["capture"] = frame->capture_ms;
+
+    t = (double) cv::getTickCount();
+    cv::Mat edges = detect_edges(*frame, opts.edge_scale);
+    times["edges"] = ms_since(t);
+
+    if (opts.verify_edges) {
+      cv::Mat reference = detect_edges_reference(frame->scaled_gray(opts.edge_scale));
+      if (opts.edge_scale < 1) {
+        cv::resize(reference, reference, frame->image.size(), 0, 0, cv::INTER_NEAREST);
+      }
+      cv::Mat diff;
+      cv::compare(edges, reference, diff, cv::CMP_NE);
+      if (cv::countNonZero(diff) > 0) {
+        result.edge_mismatches++;
+      }
+    }
+
+    t = (double) cv::getTickCount();
+    facedetection.detect(frame);
+    times["faces"] = ms_since(t);
+
+    t = (double) cv::getTickCount();
+    ar();
+    times["ar"] = ms_since(t);
+
+    t = (double) cv::getTickCount();
+    of(frame);
+    times["flow"] = ms_since(t);
+
+    if (opts.verify_flow) {
+      cv::Mat gray = frame->scaled_gray(opts.flow_scale);
+      striped_flow.load(gray);
+      if (verify_last_gray.size() == gray.size()) {
+        double const error = flow_reference_error(striped_flow, verify_last_gray, gray);
+        result.flow_max_error = std::max(result.flow_max_error, error);
+        if (error > FLOW_TOLERANCE) {
+          result.flow_mismatches++;
+        }
+      }
+      verify_last_gray = gray;
+    }
+
+    t = (double) cv::getTickCount();
+    frame->image.copyTo(image);
+    stream.applyOverlay(image);
+    times["composite"] = ms_since(t);
+
+    auto since_publication = std::chrono::steady_clock::now() - frame->timestamp;
+    times["end_to_end"] = frame->capture_ms
+      + std::chrono::duration_cast<std::chrono::microseconds>(since_publication).count() / 1000.0;
+
+    if (measured) {
+      for (auto const &time : times) {
+        result.stages[time.first].add(time.second);
+      }
+      result.frames++;
+    }
+    processed++;
+  }
+
+  if (result.frames > 0) {
+    result.duration_s = ms_since(bench_start) / 1000;
+  }
+  result.faces = facedetection.stats();
+
+  stream.stop();
+  return true;
+}
+
+// value as a quoted json string
+std::string json_string(std::string const &value)
+{
+  std::ostringstream out;
+  out << "\"";
+  for (char c : value) {
+    if ((c == '"') || (c == '\\')) {
+      out << '\\' << c;
+    } else if ((unsigned char) c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char) c);
+      out << escaped;
+    } else {
+      out << c;
+    }
+  }
+  out << "\"";
+  return out.str();
+}
+
+void write_json(std::ostream &out, BenchOptions const &opts, BenchResult const &result)
+{
+  out.setf(std::ios::fixed);
+  out.precision(3);
+
+  out << "{" << std::endl
+      << "  \"input\": " << json_string(opts.input) << "," << std::endl
+      << "  \"resolution\": \"" << opts.width << "x" << opts.height << "\"," << std::endl
+      << "  \"mode\": \"" << (opts.paced ? "paced" : "fast") << "\"," << std::endl
+      << "  \"detect_threads\": " << opts.detect_threads << "," << std::endl
+      << "  \"face_scale\": " << opts.face_scale << "," << std::endl
+      << "  \"flow_scale\": " << opts.flow_scale << "," << std::endl
+      << "  \"edge_scale\": " << opts.edge_scale << "," << std::endl
+      << "  \"frames\": " << result.frames << "," << std::endl
+      << "  \"dropped_frames\": " << result.dropped << "," << std::endl
+      << "  \"duration_s\": " << result.duration_s << "," << std::endl
+      << "  \"throughput_fps\": " << result.throughput() << "," << std::endl
+      << "  \"face_full_scans\": " << result.faces.full_scans << "," << std::endl
+      << "  \"face_roi_scans\": " << result.faces.roi_scans << "," << std::endl
+      << "  \"face_tracked_frames\": " << result.faces.tracked << "," << std::endl;
+  if (opts.verify_edges) {
+    out << "  \"edge_mismatches\": " << result.edge_mismatches << "," << std::endl;
+  }
+  if (opts.verify_flow) {
+    out << "  \"flow_mismatches\": " << result.flow_mismatches << "," << std::endl
+        << "  \"flow_max_error\": " << result.flow_max_error << "," << std::endl;
+  }
+  out
+      << "  \"stages\": {" << std::endl;
+
+  for (size_t i = 0; i < STAGES.size(); i++) {
+    auto it = result.stages.find(STAGES[i]);
+    LatencySamples const empty;
+    LatencySamples const &samples = (it != result.stages.end()) ? it->second : empty;
+
+    out << "    \"" << STAGES[i] << "\": { "
+        << "\"p50_ms\": " << samples.percentile(50) << ", "
+        << "\"p95_ms\": " << samples.percentile(95) << ", "
+        << "\"p99_ms\": " << samples.percentile(99) << ", "
+        << "\"mean_ms\": " << samples.mean() << ", "
+        << "\"max_ms\": " << samples.max() << " }"
+        << ((i + 1 < STAGES.size()) ? "," : "") << std::endl;
+  }
+
+  out << "  }" << std::endl
+      << "}" << std::endl;
+}
+
+// finds the number of "key" after the first occurrence of "object". only understands
+// the reports written by write_json
+bool find_json_number(std::string const &json, std::string const &object,
+                      std::string const &key, double &value)
+{
+  size_t pos = 0;
+  if (!object.empty()) {
+    pos = json.find("\"" + object + "\"");
+    if (pos == std::string::npos) {
+      return false;
+    }
+  }
+
+  pos = json.find("\"" + key + "\"", pos);
+  if (pos == std::string::npos) {
+    return false;
+  }
+  pos = json.find(':', pos);
+  if (pos == std::string::npos) {
+    return false;
+  }
+
+  std::istringstream in(json.substr(pos + 1));
+  return static_cast<bool>(in >> value);
+}
+
+// returns the number of regressions found, or -1 if the baseline could not be read
+int compare_baseline(std::string const &baseline_file, double threshold, BenchResult const &result)
+{
+  std::ifstream in(baseline_file);
+  if (!in) {
+    std::cerr << "could not read baseline " << baseline_file << std::endl;
+    return -1;
+  }
+  std::stringstream buffer;
+  buffer << in.rdbuf();
+  std::string const json = buffer.str();
+  // the stage names are only looked up in the stages object, they may be keys elsewhere too
+  size_t const stages_pos = json.find("\"stages\"");
+  std::string const stages = (stages_pos != std::string::npos) ? json.substr(stages_pos) : "";
+
+  // differences below this are measurement noise, even if large in percent
+  double const min_difference_ms = 0.1;
+  double const factor = 1 + threshold / 100;
+  int regressions = 0;
+
+  for (std::string const &stage : STAGES) {
+    auto it = result.stages.find(stage);
+    if (it == result.stages.end()) {
+      continue;
+    }
+
+    std::vector<std::pair<std::string, double>> const percentiles =
+    {
+      { "p50_ms", 50 }, { "p95_ms", 95 }, { "p99_ms", 99 },
+    };
+    for (auto const &p : percentiles) {
+      double base;
+      if (!find_json_number(stages, stage, p.first, base)) {
+        continue;
+      }
+
+      double now = it->second.percentile(p.second);
+      if ((now > base * factor) && ((now - base) > min_difference_ms)) {
+        std::cerr << "regression: " << stage << " " << p.first << " " << now
+                  << " ms (baseline " << base << " ms)" << std::endl;
+        regressions++;
+      }
+    }
+  }
+
+  double base_fps;
+  if (find_json_number(json, "", "throughput_fps", base_fps)
+      && (result.throughput() * factor < base_fps)) {
+    std::cerr << "regression: throughput " << result.throughput()
+              << " fps (baseline " << base_fps << " fps)" << std::endl;
+    regressions++;
+  }
+
+  return regressions;
+}
+
+int main(int argc, char **argv)
+{
+  BenchOptions opts;
+  if (check_options(opts, argc, argv) == -1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+#ifdef WITH_CUDA
+  if (!opts.cpu_flow && (cv::cuda::getCudaEnabledDeviceCount() <= 0)) {
+    opts.cpu_flow = true;
+  }
+#else
+  opts.cpu_flow = true;
+#endif
+
+  // the stages log to stdout, which only gets the report, so it stays valid json
+  std::streambuf *report = std::cout.rdbuf(std::cerr.rdbuf());
+
+  PlaybackOptions playback;
+  playback.paced = opts.paced;
+
+  LiveStream stream(opts.input, opts.width, opts.height, playback);
+  if (!stream.isOpened()) {
+    std::cerr << "Error opening input " << opts.input << std::endl;
+    return 1;
+  }
+
+  BenchResult result;
+  bool ok = false;
+#ifdef WITH_CUDA
+  if (!opts.cpu_flow) {
+    ok = run_benchmark<CudaFarnebackFlow>(stream, opts, result);
+  }
+#endif
+  if (opts.cpu_flow) {
+    ok = run_benchmark<CpuFarnebackFlow>(stream, opts, result);
+  }
+
+  std::cout.rdbuf(report);
+
+  if (!ok) {
+    return 1;
+  }
+
+  if (opts.output.empty()) {
+    write_json(std::cout, opts, result);
+  } else {
+    std::ofstream out(opts.output);
+    write_json(out, opts, result);
+    out.close();
+    if (!out) {
+      std::cerr << "could not write report " << opts.output << std::endl;
+      return 1;
+    }
+  }
+
+  if (result.edge_mismatches > 0) {
+    std::cerr << "edges of " << result.edge_mismatches << " frames differ from the reference" << std::endl;
+    return 3;
+  }
+
+  if (!opts.baseline.empty()) {
+    int regressions = compare_baseline(opts.baseline, opts.threshold, result);
+    if (regressions < 0) {
+      return 1;
+    }
+    if (regressions > 0) {
+      return 2;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,68 @@
+#include "direction-grid.h"
+
+#include <algorithm>
+
+void DirectionGrid::reset(cv::Size const &frame, int stride)
+{
+  mStride = std::max(stride, 1);
+  mFrame = frame;
+
+  mDirections.create(index(frame.height), index(frame.width), CV_8UC1);
+  mDirections = cv::Scalar(UNDEFINED);
+}
+
+void DirectionGrid::set(cv::Point const &pos, int direction)
+{
+  int const x = pos.x / mStride;
+  int const y = pos.y / mStride;
+  if ((pos.x < 0) || (pos.y < 0) || (x >= mDirections.cols) || (y >= mDirections.rows)) {
+    return;
+  }
+
+  mDirections.at<uchar>(y, x) = direction;
+}
+
+void DirectionGrid::sum()
+{
+  mSums.create(mDirections.rows + 1, mDirections.cols + 1, CV_32SC2);
+  mSums.row(0) = cv::Scalar(0, 0);
+
+  for (int y = 0; y < mDirections.rows; y++) {
+    uchar const *directions = mDirections.ptr<uchar>(y);
+    cv::Vec2i const *above = mSums.ptr<cv::Vec2i>(y);
+    cv::Vec2i *sums = mSums.ptr<cv::Vec2i>(y + 1);
+
+    cv::Vec2i row(0, 0);
+    sums[0] = row;
+    for (int x = 0; x < mDirections.cols; x++) {
+      row[0] += (directions[x] == APPROACHING);
+      row[1] += (directions[x] == DISTANCING);
+      sums[x + 1] = above[x + 1] + row;
+    }
+  }
+}
+
+DirectionGrid::Counts DirectionGrid::count(cv::Rect const &rect) const
+{
+  cv::Rect const r = rect & cv::Rect(0, 0, mFrame.width, mFrame.height);
+
+  Counts counts = { 0, 0 };
+  if (r.area() == 0) {
+    return counts;
+  }
+
+  // grid points inside of the rect, the end is exclusive
+  int const x0 = index(r.x);
+  int const x1 = std::min(index(r.x + r.width), mDirections.cols);
+  int const y0 = index(r.y);
+  int const y1 = std::min(index(r.y + r.height), mDirections.rows);
+  if ((x0 >= x1) || (y0 >= y1)) {
+    return counts;
+  }
+
+  cv::Vec2i const n = mSums.at<cv::Vec2i>(y1, x1) - mSums.at<cv::Vec2i>(y0, x1)
+                    - mSums.at<cv::Vec2i>(y1, x0) + mSums.at<cv::Vec2i>(y0, x0);
+  counts.approaching = n[0];
+  counts.distancing = n[1];
+  return counts;
+}
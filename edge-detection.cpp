@@ -0,0 +1,189 @@
+#include "edge-detection.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+#include "opencv2/imgproc.hpp"
+
+#include "metrics.h"
+
+namespace {
+
+cv::Size const BLUR_SIZE(7, 7);
+double const BLUR_SIGMA = 2.5;
+int const CANNY_LOW = 1;
+int const CANNY_HIGH = 25;
+
+// small enough for the blurred and differentiated rows of a stripe to stay in cache
+int const STRIPE_ROWS = 32;
+// the magnitudes one row around a stripe are compared with its pixels and their
+// gradients need one more row of the blurred image
+int const STRIPE_MARGIN = 2;
+
+// same fixed point tangent of 22.5 degrees as cv::Canny
+int const CANNY_SHIFT = 15;
+int const TG22 = (int) (0.4142135623730950488016887242097 * (1 << CANNY_SHIFT) + 0.5);
+
+/*
+ * Blurs, differentiates and thins a range of stripes, one stripe at a time. Every pixel
+ * is classified in map like cv::Canny does it: 1 is no edge, 0 a weak and 2 a strong one.
+ * map has a border of one pixel around the frame.
+ */
+class EdgeStripes : public cv::ParallelLoopBody {
+
+private:
+  cv::Mat const &mGray;
+  cv::Mat &mMap;
+  std::vector<std::vector<uchar *>> &mStrong;
+  int mStripes;
+
+  void stripe(int i) const
+  {
+    int const rows = mGray.rows;
+    int const cols = mGray.cols;
+    int const top = rows * i / mStripes;
+    int const bottom = rows * (i + 1) / mStripes;
+    int const ext_top = std::max(0, top - STRIPE_MARGIN);
+    int const ext_bottom = std::min(rows, bottom + STRIPE_MARGIN);
+
+    // filtering a part of the frame reads the rows around it from the frame, the blurred
+    // rows are the same as the ones of the whole blurred frame
+    cv::Mat blurred, dx, dy;
+    cv::GaussianBlur(mGray.rowRange(ext_top, ext_bottom), blurred, BLUR_SIZE, BLUR_SIGMA, BLUR_SIGMA);
+    // the first and last row replicate the border of the part. they are only used where
+    // that is the border of the frame
+    cv::Sobel(blurred, dx, CV_16S, 1, 0, 3, 1, 0, cv::BORDER_REPLICATE);
+    cv::Sobel(blurred, dy, CV_16S, 0, 1, 3, 1, 0, cv::BORDER_REPLICATE);
+
+    // l1 magnitude of the stripe and one row around it, 0 outside of the frame
+    cv::Mat mag = cv::Mat::zeros(bottom - top + 2, cols + 2, CV_32S);
+    for (int r = std::max(0, top - 1); r < std::min(rows, bottom + 1); r++) {
+      short const *x = dx.ptr<short>(r - ext_top);
+      short const *y = dy.ptr<short>(r - ext_top);
+      int *m = mag.ptr<int>(r - top + 1) + 1;
+      for (int j = 0; j < cols; j++) {
+        m[j] = std::abs(x[j]) + std::abs(y[j]);
+      }
+    }
+
+    // non maximum suppression along the direction of the gradient
+    std::vector<uchar *> &strong = mStrong[i];
+    for (int r = top; r < bottom; r++) {
+      short const *x = dx.ptr<short>(r - ext_top);
+      short const *y = dy.ptr<short>(r - ext_top);
+      int const *above = mag.ptr<int>(r - top) + 1;
+      int const *m = mag.ptr<int>(r - top + 1) + 1;
+      int const *below = mag.ptr<int>(r - top + 2) + 1;
+      uchar *map = mMap.ptr<uchar>(r + 1) + 1;
+
+      for (int j = 0; j < cols; j++) {
+        bool maximum = false;
+
+        if (m[j] > CANNY_LOW) {
+          int const ax = std::abs(x[j]);
+          int const ay = std::abs(y[j]) << CANNY_SHIFT;
+          int const tg22x = ax * TG22;
+
+          if (ay < tg22x) {
+            maximum = (m[j] > m[j - 1]) && (m[j] >= m[j + 1]);
+          } else {
+            int const tg67x = tg22x + (ax << (CANNY_SHIFT + 1));
+            if (ay > tg67x) {
+              maximum = (m[j] > above[j]) && (m[j] >= below[j]);
+            } else {
+              int const s = ((x[j] ^ y[j]) < 0) ? -1 : 1;
+              maximum = (m[j] > above[j - s]) && (m[j] > below[j + s]);
+            }
+          }
+        }
+
+        if (!maximum) {
+          map[j] = 1;
+        } else if (m[j] > CANNY_HIGH) {
+          map[j] = 2;
+          strong.push_back(map + j);
+        } else {
+          map[j] = 0;
+        }
+      }
+    }
+  }
+
+public:
+  EdgeStripes(cv::Mat const &gray, cv::Mat &map, std::vector<std::vector<uchar *>> &strong, int stripes)
+             : mGray(gray), mMap(map), mStrong(strong), mStripes(stripes)
+  {
+  }
+
+  void operator()(cv::Range const &range) const
+  {
+    for (int i = range.start; i < range.end; i++) {
+      stripe(i);
+    }
+  }
+};
+
+cv::Mat canny_tiled(cv::Mat const &gray)
+{
+  int const stripes = std::max(1, gray.rows / STRIPE_ROWS);
+
+  cv::Mat map(gray.rows + 2, gray.cols + 2, CV_8U, cv::Scalar(1));
+  std::vector<std::vector<uchar *>> strong(stripes);
+
+  cv::parallel_for_(cv::Range(0, stripes), EdgeStripes(gray, map, strong, stripes));
+
+  // hysteresis: weak edges connected to a strong one become strong. it crosses the
+  // stripes and is cheap compared to the filters, so it runs on this thread
+  std::vector<uchar *> stack;
+  for (std::vector<uchar *> const &s : strong) {
+    stack.insert(stack.end(), s.begin(), s.end());
+  }
+
+  ptrdiff_t const step = map.step;
+  ptrdiff_t const neighbours[] =
+  {
+    -step - 1, -step, -step + 1, -1, 1, step - 1, step, step + 1
+  };
+
+  while (!stack.empty()) {
+    uchar *m = stack.back();
+    stack.pop_back();
+
+    for (ptrdiff_t n : neighbours) {
+      if (m[n] == 0) {
+        m[n] = 2;
+        stack.push_back(m + n);
+      }
+    }
+  }
+
+  cv::Mat edges;
+  cv::compare(map(cv::Rect(1, 1, gray.cols, gray.rows)), 2, edges, cv::CMP_EQ);
+  return edges;
+}
+
+}
+
+cv::Mat detect_edges(Frame const &frame, double scale)
+{
+  static Histogram &latency = stage_latency("edges");
+  ScopedTimer timer(latency);
+
+  cv::Mat edges = canny_tiled(frame.scaled_gray(scale));
+
+  if (scale < 1) {
+    // nearest neighbour keeps the edge image binary
+    cv::resize(edges, edges, frame.image.size(), 0, 0, cv::INTER_NEAREST);
+  }
+
+  return edges;
+}
+
+cv::Mat detect_edges_reference(cv::Mat const &gray)
+{
+  cv::Mat edges;
+  cv::GaussianBlur(gray, edges, BLUR_SIZE, BLUR_SIGMA, BLUR_SIGMA);
+  cv::Canny(edges, edges, CANNY_LOW, CANNY_HIGH, 3);
+  return edges;
+}
@@ -0,0 +1,112 @@
+#include "face-tracker.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "opencv2/imgproc.hpp"
+#include "opencv2/video.hpp"
+
+namespace {
+
+float median(std::vector<float> &values)
+{
+  auto middle = values.begin() + values.size() / 2;
+  std::nth_element(values.begin(), middle, values.end());
+  return *middle;
+}
+
+}
+
+void FaceTracker::reset(cv::Mat const &gray)
+{
+  cv::buildOpticalFlowPyramid(gray, mLastPyramid, WIN_SIZE, MAX_LEVEL);
+  mHasFrame = true;
+}
+
+double FaceTracker::track(cv::Mat const &gray, std::vector<cv::Rect> &faces)
+{
+  if (!mHasFrame) {
+    reset(gray);
+    return 0;
+  }
+
+  cv::buildOpticalFlowPyramid(gray, mNowPyramid, WIN_SIZE, MAX_LEVEL);
+
+  double confidence = 1;
+  for (cv::Rect &face : faces) {
+    confidence = std::min(confidence, track_face(face));
+  }
+
+  std::swap(mLastPyramid, mNowPyramid);
+  return confidence;
+}
+
+double FaceTracker::track_face(cv::Rect &face)
+{
+  cv::Mat const &last = mLastPyramid[0];
+  cv::Rect const bounds(0, 0, last.cols, last.rows);
+
+  cv::Rect roi = face & bounds;
+  if (roi.area() == 0) {
+    face = cv::Rect();
+    return 0;
+  }
+
+  std::vector<cv::Point2f> points;
+  cv::goodFeaturesToTrack(last(roi), points, MAX_CORNERS, CORNER_QUALITY, CORNER_MIN_DISTANCE);
+  if (points.size() < MIN_POINTS) {
+    face = cv::Rect();
+    return 0;
+  }
+  for (cv::Point2f &p : points) {
+    p += cv::Point2f(roi.x, roi.y);
+  }
+
+  // track forward and back again, points that do not return are unreliable
+  std::vector<cv::Point2f> next, back;
+  std::vector<uchar> status, back_status;
+  std::vector<float> error;
+  cv::calcOpticalFlowPyrLK(mLastPyramid, mNowPyramid, points, next, status, error,
+                           WIN_SIZE, MAX_LEVEL);
+  cv::calcOpticalFlowPyrLK(mNowPyramid, mLastPyramid, next, back, back_status, error,
+                           WIN_SIZE, MAX_LEVEL);
+
+  std::vector<cv::Point2f> from, to;
+  for (size_t i = 0; i < points.size(); i++) {
+    cv::Point2f d = back[i] - points[i];
+    if (status[i] && back_status[i] && (d.dot(d) <= MAX_FORWARD_BACKWARD_ERROR * MAX_FORWARD_BACKWARD_ERROR)) {
+      from.push_back(points[i]);
+      to.push_back(next[i]);
+    }
+  }
+
+  double const confidence = (double) from.size() / points.size();
+  if (from.size() < MIN_POINTS) {
+    face = cv::Rect();
+    return confidence;
+  }
+
+  std::vector<float> dx, dy, scales;
+  for (size_t i = 0; i < from.size(); i++) {
+    dx.push_back(to[i].x - from[i].x);
+    dy.push_back(to[i].y - from[i].y);
+
+    // change of the distance to the next point as a measure of the change in size
+    size_t j = (i + 1) % from.size();
+    cv::Point2f d_from = from[j] - from[i];
+    cv::Point2f d_to = to[j] - to[i];
+    double dist_from = std::sqrt(d_from.dot(d_from));
+    if (dist_from > 1) {
+      scales.push_back(std::sqrt(d_to.dot(d_to)) / dist_from);
+    }
+  }
+
+  float const scale = scales.empty() ? 1 : median(scales);
+  cv::Point2f const center(face.x + face.width / 2.f + median(dx),
+                           face.y + face.height / 2.f + median(dy));
+  cv::Size2f const size(face.width * scale, face.height * scale);
+
+  face = cv::Rect(cvRound(center.x - size.width / 2), cvRound(center.y - size.height / 2),
+                  cvRound(size.width), cvRound(size.height));
+  return confidence;
+}
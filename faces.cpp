@@ -1,43 +1,238 @@
 #include "faces.h"
 
-void Faces::addFace(cv::Rect &face)
+#include <algorithm>
+#include <tuple>
+#include <unordered_map>
+
+namespace {
+
+double iou(cv::Rect const &a, cv::Rect const &b)
 {
-  for (auto &f : mFaces) {
-    cv::Rect intersect = f.face & face;
-    if (intersect.width > 0) {
-      f.face = face;
-      f.ttl = DEFAULT_TTL;
+  int const intersection = (a & b).area();
+  if (intersection == 0) {
+    return 0;
+  }
+  return (double) intersection / (a.area() + b.area() - intersection);
+}
+
+// buckets rects into square cells about the size of a rect, so the rects overlapping
+// another one are found without comparing it to all of them
+class RectGrid {
+
+private:
+  int mCell = 1;
+  std::unordered_map<uint64_t, std::vector<int>> mCells;
+  // query in which a rect was last found, to report rects spanning several cells once
+  std::vector<int> mFound;
+  int mQuery = 0;
+
+  static uint64_t key(int x, int y)
+  {
+    return ((uint64_t) (uint32_t) x << 32) | (uint32_t) y;
+  }
+
+  template <typename TFun>
+  void cells(cv::Rect const &rect, TFun fun) const
+  {
+    int const x0 = cvFloor((double) rect.x / mCell);
+    int const x1 = cvFloor((double) (rect.x + rect.width - 1) / mCell);
+    int const y0 = cvFloor((double) rect.y / mCell);
+    int const y1 = cvFloor((double) (rect.y + rect.height - 1) / mCell);
+    for (int y = y0; y <= y1; y++) {
+      for (int x = x0; x <= x1; x++) {
+        fun(key(x, y));
+      }
+    }
+  }
+
+public:
+  RectGrid(std::vector<cv::Rect> const &rects) : mFound(rects.size(), -1)
+  {
+    if (rects.empty()) {
+      return;
+    }
+
+    long width = 0;
+    for (cv::Rect const &rect : rects) {
+      width += rect.width;
+    }
+    mCell = std::max<int>(width / rects.size(), 16);
+
+    for (size_t i = 0; i < rects.size(); i++) {
+      if (rects[i].area() > 0) {
+        cells(rects[i], [this, i](uint64_t k) { mCells[k].push_back(i); });
+      }
+    }
+  }
+
+  // indices of the rects sharing a cell with rect
+  void query(cv::Rect const &rect, std::vector<int> &found)
+  {
+    found.clear();
+    if (rect.area() == 0) {
       return;
     }
+
+    mQuery++;
+    cells(rect, [this, &found](uint64_t k)
+          {
+            auto cell = mCells.find(k);
+            if (cell == mCells.end()) {
+              return;
+            }
+            for (int i : cell->second) {
+              if (mFound[i] != mQuery) {
+                mFound[i] = mQuery;
+                found.push_back(i);
+              }
+            }
+          });
   }
+};
 
-  // no intersecting face found -> add new face
-  FaceEntry f = { face, DEFAULT_TTL };
-  mFaces.emplace_back(f);
 }
 
-void Faces::tick()
+Faces::Faces() : mSnapshot(std::make_shared<FaceList>())
+{
+}
+
+void Faces::publish()
+{
+  std::shared_ptr<FaceList> faces = std::make_shared<FaceList>();
+  faces->reserve(mTracks.size());
+  for (Track const &track : mTracks) {
+    faces->push_back(track.face);
+  }
+  std::atomic_store(&mSnapshot, FacesSnapshot(faces));
+}
+
+void Faces::addFaces(std::vector<cv::Rect> const &detections)
 {
-  std::unique_lock<std::mutex> l(mMutex);
-  for (auto &f : mFaces) {
-    f.ttl--;
+  std::lock_guard<std::mutex> l(mWriteMutex);
+
+  std::vector<cv::Rect> tracked;
+  for (Track const &track : mTracks) {
+    tracked.push_back(track.face.rect);
   }
+  RectGrid tracks(tracked);
+  RectGrid detected(detections);
 
-  auto end = std::remove_if(mFaces.begin(), mFaces.end(),
-                            [](FaceEntry const &f) { return f.ttl <= 0; });
-  mFaces.erase(end, mFaces.end());
+  // every overlapping pair, the best ones are assigned first
+  std::vector<std::tuple<double, int, int>> pairs;
+  std::vector<int> found;
+  for (size_t d = 0; d < detections.size(); d++) {
+    tracks.query(detections[d], found);
+    for (int t : found) {
+      double const overlap = iou(detections[d], tracked[t]);
+      if (overlap >= MIN_IOU) {
+        // lower indices first among equal overlaps, to assign the same way every time
+        pairs.push_back(std::make_tuple(overlap, -(int) d, -t));
+      }
+    }
+  }
+  std::sort(pairs.rbegin(), pairs.rend());
+
+  std::vector<bool> assigned(detections.size(), false);
+  std::vector<bool> track_assigned(mTracks.size(), false);
+  for (auto const &pair : pairs) {
+    int const d = -std::get<1>(pair);
+    int const t = -std::get<2>(pair);
+    if (assigned[d] || track_assigned[t]) {
+      continue;
+    }
+
+    mTracks[t].face.rect = detections[d];
+    mTracks[t].ttl = DEFAULT_TTL;
+    assigned[d] = true;
+    track_assigned[t] = true;
+  }
+
+  // another track on an assigned detection followed the same face
+  std::vector<bool> duplicate(mTracks.size(), false);
+  for (size_t t = 0; t < tracked.size(); t++) {
+    if (track_assigned[t]) {
+      continue;
+    }
+    detected.query(tracked[t], found);
+    for (int d : found) {
+      if (assigned[d] && (iou(tracked[t], detections[d]) >= MIN_IOU)) {
+        duplicate[t] = true;
+        break;
+      }
+    }
+  }
+
+  // the remaining detections are new faces, unless the same face was found twice
+  std::vector<bool> accepted(assigned);
+  for (size_t d = 0; d < detections.size(); d++) {
+    if (assigned[d]) {
+      continue;
+    }
+    detected.query(detections[d], found);
+    bool seen = false;
+    for (int other : found) {
+      if (accepted[other] && (iou(detections[d], detections[other]) >= MIN_IOU)) {
+        seen = true;
+        break;
+      }
+    }
+    if (seen) {
+      continue;
+    }
+
+    accepted[d] = true;
+    Track track = { { mNextId++, detections[d] }, DEFAULT_TTL };
+    mTracks.push_back(track);
+    duplicate.push_back(false);
+  }
+
+  size_t kept = 0;
+  for (size_t t = 0; t < mTracks.size(); t++) {
+    if (!duplicate[t]) {
+      mTracks[kept++] = mTracks[t];
+    }
+  }
+  mTracks.resize(kept);
+
+  publish();
 }
 
-std::mutex &Faces::getMutex()
+void Faces::updateFaces(FaceList const &faces)
 {
-  return mMutex;
+  std::lock_guard<std::mutex> l(mWriteMutex);
+
+  std::unordered_map<uint64_t, cv::Rect const *> moved;
+  for (Face const &face : faces) {
+    moved[face.id] = &face.rect;
+  }
+
+  for (Track &track : mTracks) {
+    auto face = moved.find(track.face.id);
+    if (face != moved.end()) {
+      track.face.rect = *face->second;
+      track.ttl = DEFAULT_TTL;
+    }
+  }
+
+  publish();
 }
 
-std::vector<cv::Rect> Faces::getFaces()
+void Faces::tick()
 {
-  std::vector<cv::Rect> faces;
-  for (auto &f : mFaces) {
-    faces.push_back(f.face);
+  std::lock_guard<std::mutex> l(mWriteMutex);
+
+  for (Track &track : mTracks) {
+    track.ttl--;
   }
-  return faces;
+
+  auto end = std::remove_if(mTracks.begin(), mTracks.end(),
+                            [](Track const &track) { return track.ttl <= 0; });
+  mTracks.erase(end, mTracks.end());
+
+  publish();
+}
+
+FacesSnapshot Faces::snapshot() const
+{
+  return std::atomic_load(&mSnapshot);
 }
@@ -0,0 +1,215 @@
+#include "flow-backends.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "opencv2/video.hpp"
+
+namespace {
+
+// motion in pixels per frame the stripe margin accounts for. larger motions can still
+// show seams at the stripe borders once the flow is refined on an estimate
+int const MAX_DISPLACEMENT = 16;
+
+// opencv 3.0 does not compute pyramid levels smaller than this in either dimension
+int const MIN_LEVEL_SIZE = 32;
+// rows at the border of every level that FarnebackUpdateMatrices weights differently
+int const BORDER_ROWS = 5;
+
+// computes the flow of a range of stripes. opencv 3.0 parallel_for_ does not take lambdas
+class FarnebackStripes : public cv::ParallelLoopBody {
+
+private:
+  cv::Mat const &mLast;
+  cv::Mat const &mNow;
+  cv::Mat &mFlowX;
+  cv::Mat &mFlowY;
+  FarnebackParams const &mParams;
+  int mStripes;
+  int mMargin;
+  // the extended stripes start and end at multiples of this, so their coarse levels
+  // sample the same rows as the ones of the whole frame
+  int mAlign;
+
+public:
+  FarnebackStripes(cv::Mat const &last, cv::Mat const &now, cv::Mat &flowx, cv::Mat &flowy,
+                   FarnebackParams const &params, int stripes, int margin, int align)
+                  : mLast(last), mNow(now), mFlowX(flowx), mFlowY(flowy),
+                    mParams(params), mStripes(stripes), mMargin(margin), mAlign(align)
+  {
+  }
+
+  void operator()(cv::Range const &range) const
+  {
+    int const rows = mNow.rows;
+    FarnebackParams const &p = mParams;
+
+    for (int i = range.start; i < range.end; i++) {
+      int top = rows * i / mStripes;
+      int bottom = rows * (i + 1) / mStripes;
+      int ext_top = std::max(0, (top - mMargin) / mAlign * mAlign);
+      int ext_bottom = std::min(rows, (bottom + mMargin + mAlign - 1) / mAlign * mAlign);
+
+      cv::Mat flow;
+      cv::calcOpticalFlowFarneback(mLast.rowRange(ext_top, ext_bottom),
+                                   mNow.rowRange(ext_top, ext_bottom),
+                                   flow, p.pyrScale, p.numLevels, p.winSize,
+                                   p.numIters, p.polyN, p.polySigma, p.flags);
+
+      // write the stripe without its margin straight into the output planes
+      cv::Mat parts[] = { mFlowX.rowRange(top, bottom), mFlowY.rowRange(top, bottom) };
+      cv::split(flow.rowRange(top - ext_top, bottom - ext_top), parts);
+    }
+  }
+};
+
+}
+
+#ifdef WITH_CUDA
+CudaFarnebackFlow::CudaFarnebackFlow()
+{
+  mNowGpuImg = &mGpuImg1;
+  mLastGpuImg = &mGpuImg2;
+  setParams(FarnebackParams());
+}
+
+void CudaFarnebackFlow::setParams(FarnebackParams const &params)
+{
+  mFarneback.numLevels = params.numLevels;
+  mFarneback.pyrScale = params.pyrScale;
+  mFarneback.fastPyramids = params.fastPyramids;
+  mFarneback.winSize = params.winSize;
+  mFarneback.numIters = params.numIters;
+  mFarneback.polyN = params.polyN;
+  mFarneback.polySigma = params.polySigma;
+  mFarneback.flags = params.flags;
+}
+
+void CudaFarnebackFlow::load(cv::Mat const &gray)
+{
+  // swap pointers to avoid reallocating memory on gpu
+  std::swap(mNowGpuImg, mLastGpuImg);
+  mNowGpuImg->upload(gray);
+}
+
+void CudaFarnebackFlow::calc(cv::Mat &flowx, cv::Mat &flowy,
+                             double &calc_time_ms, double &dl_time_ms)
+{
+  cv::cuda::GpuMat d_flowx, d_flowy;
+
+  double calc_start = (double) cv::getTickCount();
+  mFarneback(*mLastGpuImg, *mNowGpuImg, d_flowx, d_flowy, mCudaStream);
+  calc_time_ms = ((double) cv::getTickCount() - calc_start) / cv::getTickFrequency() * 1000;
+
+  double dl_start = (double) cv::getTickCount();
+  d_flowx.download(flowx);
+  d_flowy.download(flowy);
+  dl_time_ms = ((double) cv::getTickCount() - dl_start) / cv::getTickFrequency() * 1000;
+}
+#endif
+
+CpuFarnebackFlow::CpuFarnebackFlow(int threads)
+{
+  mNowImg = &mImg1;
+  mLastImg = &mImg2;
+  setThreads(threads);
+}
+
+void CpuFarnebackFlow::setThreads(int threads)
+{
+  mThreads = (threads > 0) ? threads : cv::getNumberOfCPUs();
+}
+
+void CpuFarnebackFlow::setParams(FarnebackParams const &params)
+{
+  mParams = params;
+}
+
+void CpuFarnebackFlow::load(cv::Mat const &gray)
+{
+  // the grayscale frame is not written anymore by its producer, keep a reference only
+  std::swap(mNowImg, mLastImg);
+  *mNowImg = gray;
+}
+
+int CpuFarnebackFlow::pyramid_levels(cv::Size const &size) const
+{
+  // calcOpticalFlowFarneback computes numLevels levels on top of the image itself, as
+  // long as they do not get too small
+  int levels = 0;
+  double scale = 1;
+  for (; levels < mParams.numLevels; levels++) {
+    scale *= mParams.pyrScale;
+    if ((size.width * scale < MIN_LEVEL_SIZE) || (size.height * scale < MIN_LEVEL_SIZE)) {
+      break;
+    }
+  }
+  return levels;
+}
+
+int CpuFarnebackFlow::stripe_margin(int levels) const
+{
+  // rows outside a stripe that contribute to its flow on every level: the rows weighted
+  // differently at the border or the polynomial expansion neighbourhood, the averaging
+  // window of every iteration, and a row each for resizing the image and the flow of
+  // the coarser level
+  int const level_margin = std::max(BORDER_ROWS, mParams.polyN / 2)
+                           + mParams.numIters * (mParams.winSize / 2) + 2;
+
+  // the coarser levels are the estimate the finer ones start from, their margins add up
+  double margin = 0;
+  double scale = 1;
+  for (int level = 0; level <= levels; level++) {
+    margin += level_margin / scale;
+    if (level > 0) {
+      // the image is smoothed at full size before it is scaled down to the level
+      double const sigma = (1 / scale - 1) * 0.5;
+      int const smooth_size = std::max(cvRound(sigma * 5) | 1, 3);
+      margin += smooth_size / 2;
+    }
+    scale *= mParams.pyrScale;
+  }
+
+  // every iteration but the very first samples the second frame at x + d of the flow
+  // estimated so far, which reaches further out by up to the displacement each time
+  int const refinements = (levels + 1) * mParams.numIters - 1;
+  return cvCeil(margin) + refinements * MAX_DISPLACEMENT;
+}
+
+void CpuFarnebackFlow::calc(cv::Mat &flowx, cv::Mat &flowy,
+                            double &calc_time_ms, double &dl_time_ms)
+{
+  cv::Mat const &last = *mLastImg;
+  cv::Mat const &now = *mNowImg;
+
+  double calc_start = (double) cv::getTickCount();
+
+  flowx.create(now.size(), CV_32FC1);
+  flowy.create(now.size(), CV_32FC1);
+
+  if (last.size() != now.size()) {
+    // only a single frame loaded so far
+    flowx = cv::Scalar(0);
+    flowy = cv::Scalar(0);
+    calc_time_ms = dl_time_ms = 0;
+    return;
+  }
+
+  int const rows = now.rows;
+  int const levels = pyramid_levels(now.size());
+  int const margin = stripe_margin(levels);
+  double const coarsest = std::pow(mParams.pyrScale, levels);
+  int const align = std::max(1, cvRound(1 / coarsest));
+
+  // stripes thinner than their margin would mostly compute rows of their neighbours, and
+  // stripes too small for the coarsest level of the whole frame would skip it
+  int const min_rows = std::max(2 * margin, cvCeil(MIN_LEVEL_SIZE / coarsest));
+  int const stripes = std::max(1, std::min(mThreads, rows / std::max(1, min_rows)));
+
+  cv::parallel_for_(cv::Range(0, stripes),
+                    FarnebackStripes(last, now, flowx, flowy, mParams, stripes, margin, align));
+
+  calc_time_ms = ((double) cv::getTickCount() - calc_start) / cv::getTickFrequency() * 1000;
+  // the flow is computed in host memory, there is nothing to download
+  dl_time_ms = 0;
+}
@@ -0,0 +1,127 @@
+#include "frame.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "opencv2/imgproc.hpp"
+
+std::shared_ptr<DerivedImages::Entry> DerivedImages::entry(std::shared_ptr<Entry> &slot)
+{
+  std::unique_lock<std::mutex> l(mMutex);
+  if (!slot) {
+    slot = std::make_shared<Entry>();
+  }
+  return slot;
+}
+
+template <typename TFun>
+cv::Mat DerivedImages::get(std::shared_ptr<Entry> const &entry, TFun compute)
+{
+  bool computed = false;
+  std::call_once(entry->once, [&]() { entry->image = compute(); computed = true; });
+  (computed ? mMisses : mHits).inc();
+
+  return entry->image;
+}
+
+cv::Mat DerivedImages::gray(cv::Mat const &image)
+{
+  return get(entry(mLevels[0]), [&image]()
+             {
+               cv::Mat gray;
+               cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+               return gray;
+             });
+}
+
+cv::Mat DerivedImages::pyramid(cv::Mat const &image, int level)
+{
+  level = std::min(std::max(level, 0), MAX_LEVELS - 1);
+  if (level == 0) {
+    return gray(image);
+  }
+
+  return get(entry(mLevels[level]), [this, &image, level]()
+             {
+               cv::Mat down;
+               cv::pyrDown(pyramid(image, level - 1), down);
+               return down;
+             });
+}
+
+cv::Mat DerivedImages::scaled(cv::Mat const &image, double scale)
+{
+  if (scale >= 1) {
+    return gray(image);
+  }
+
+  // the smallest pyramid level that is still at least as large as the requested scale
+  double const levels = std::log2(1 / scale);
+  int const level = std::min<int>(std::floor(levels + 1e-6), MAX_LEVELS - 1);
+  double const rest = scale * (1 << level);
+  if (rest > 1 - 1e-6) {
+    return pyramid(image, level);
+  }
+
+  int const key = cvRound(scale * 1000);
+  std::shared_ptr<Entry> scaled_entry;
+  {
+    std::unique_lock<std::mutex> l(mMutex);
+    auto it = std::find_if(mScaled.begin(), mScaled.end(),
+                           [key](std::pair<int, std::shared_ptr<Entry>> const &e) { return e.first == key; });
+    if (it == mScaled.end()) {
+      mScaled.emplace_back(key, std::make_shared<Entry>());
+      it = mScaled.end() - 1;
+    }
+    scaled_entry = it->second;
+  }
+
+  return get(scaled_entry, [this, &image, level, rest]()
+             {
+               cv::Mat scaled;
+               cv::resize(pyramid(image, level), scaled, cv::Size(), rest, rest, cv::INTER_AREA);
+               return scaled;
+             });
+}
+
+void DerivedImages::clear()
+{
+  std::unique_lock<std::mutex> l(mMutex);
+  for (auto &level : mLevels) {
+    level.reset();
+  }
+  mScaled.clear();
+}
+
+FramePool::FramePool(size_t capacity) : mFree(std::make_shared<FreeList>())
+{
+  mFree->capacity = capacity;
+}
+
+std::shared_ptr<Frame> FramePool::acquire(bool &allocated)
+{
+  std::unique_ptr<Frame> frame;
+  {
+    std::unique_lock<std::mutex> l(mFree->mutex);
+    if (!mFree->frames.empty()) {
+      frame = std::move(mFree->frames.back());
+      mFree->frames.pop_back();
+    }
+  }
+
+  allocated = !frame;
+  if (allocated) {
+    frame.reset(new Frame());
+  }
+
+  std::shared_ptr<FreeList> free = mFree;
+  return std::shared_ptr<Frame>(frame.release(), [free](Frame *returned)
+                                {
+                                  // deleted after the lock is released when the list is full
+                                  std::unique_ptr<Frame> owned(returned);
+                                  std::unique_lock<std::mutex> l(free->mutex);
+                                  if (free->frames.size() < free->capacity) {
+                                    free->frames.push_back(std::move(owned));
+                                  }
+                                });
+}
@@ -1,9 +1,13 @@
 #ifndef ALPHA_IMAGE_H_INCLUDED
 #define ALPHA_IMAGE_H_INCLUDED
 
+#include <memory>
+
 #include "opencv2/core/core.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
 
+#include "sprite-cache.h"
+
 class AlphaImage {
 
 private:
@@ -14,6 +18,14 @@ private:
   double mToFaceWidthScale;
   double mToFaceOffset;
 
+  // scaled sprites are cached per quantized width, faces changing their size by a
+  // few pixels reuse the same sprite
+  static int const WIDTH_QUANTUM = 4;
+  static size_t const DEFAULT_CACHE_BUDGET = 8 * 1024 * 1024;
+  std::unique_ptr<SpriteCache> mCache;
+
+  Sprite scaled(int width) const;
+
 public:
   AlphaImage(std::string filename, double to_face_scale, double to_face_offset);
 
@@ -25,7 +37,11 @@ public:
   int height(int face_width) const;
   int offset(int face_width) const;
 
-  void write_scaled(cv::Mat &color, cv::Mat &alpha, cv::Rect targetROI) const;
+  // returns the area of color and alpha that was written to
+  cv::Rect write_scaled(cv::Mat &color, cv::Mat &alpha, cv::Rect targetROI) const;
+
+  void setCacheBudget(size_t bytes);
+  SpriteCacheStats cacheStats() const;
 };
 
 
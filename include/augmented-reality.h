@@ -9,6 +9,7 @@
 #include "alpha-image.h"
 #include "faces.h"
 #include "livestream.h"
+#include "metrics.h"
 
 class AugmentedReality {
 
@@ -18,10 +19,15 @@ private:
 
   std::vector<AlphaImage> mHats;
 
+  Histogram &mLatency = stage_latency("ar");
+
 public:
   AugmentedReality(LiveStream &stream, Faces *faces);
 
   void addHat(std::string const &file, double width_scale, double x_offset_scale);
+  // memory budget of the scaled sprite cache of every hat
+  void setSpriteCacheBudget(size_t bytes);
+  SpriteCacheStats spriteCacheStats() const;
 
   bool ready();
   void operator()();
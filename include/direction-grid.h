@@ -0,0 +1,47 @@
+#ifndef DIRECTION_GRID_H_INCLUDED
+#define DIRECTION_GRID_H_INCLUDED
+
+#include "opencv2/core.hpp"
+
+/*
+ * Direction of the flow at the points of the sample grid of the visualizations. The
+ * grid keeps running sums of the approaching and distancing points, so the points inside
+ * of a block or a face are counted in constant time instead of visiting its pixels.
+ */
+class DirectionGrid {
+
+public:
+  static int const UNDEFINED = 0;
+  static int const APPROACHING = 1;
+  static int const DISTANCING = 2;
+
+  struct Counts {
+    int approaching;
+    int distancing;
+  };
+
+private:
+  int mStride = 1;
+  cv::Size mFrame;
+  // one cell per grid point
+  cv::Mat mDirections;
+  // approaching and distancing points above and left of every cell, one row and column
+  // larger than the grid
+  cv::Mat mSums;
+
+  // index of the first grid point at or after the frame coordinate
+  int index(int coord) const { return (coord + mStride - 1) / mStride; }
+
+public:
+  // clears the grid for a frame of this size with a point every stride pixels
+  void reset(cv::Size const &frame, int stride);
+  // pos is a point of the grid in frame coordinates, setting it again overwrites it
+  void set(cv::Point const &pos, int direction);
+  // builds the running sums once all points are set, before counting
+  void sum();
+
+  // points inside of rect in frame coordinates
+  Counts count(cv::Rect const &rect) const;
+};
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef EDGE_DETECTION_H_INCLUDED
+#define EDGE_DETECTION_H_INCLUDED
+
+#include "opencv2/core.hpp"
+
+#include "frame.h"
+
+// edges of the frame, detected on a copy scaled by scale and returned in the frame size.
+// the frame is split into stripes that are blurred, differentiated and thinned in parallel
+cv::Mat detect_edges(Frame const &frame, double scale = 1);
+
+// the same edges from cv::GaussianBlur and cv::Canny on the whole image, to verify the
+// stripes against
+cv::Mat detect_edges_reference(cv::Mat const &gray);
+
+#endif
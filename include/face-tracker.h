@@ -0,0 +1,43 @@
+#ifndef FACE_TRACKER_H_INCLUDED
+#define FACE_TRACKER_H_INCLUDED
+
+#include <vector>
+
+#include "opencv2/core.hpp"
+
+/*
+ * Carries detected faces forward between cascade detections. Corners inside every
+ * face box are followed with sparse optical flow from the last frame to the new one,
+ * the box is moved by their median motion and scaled by their median spread.
+ */
+class FaceTracker {
+
+private:
+  std::vector<cv::Mat> mLastPyramid;
+  std::vector<cv::Mat> mNowPyramid;
+  bool mHasFrame = false;
+
+  int const MAX_CORNERS = 40;
+  double const CORNER_QUALITY = 0.01;
+  double const CORNER_MIN_DISTANCE = 4;
+  // fewer points can not give a reliable median
+  size_t const MIN_POINTS = 6;
+  // a point that does not come back to where it started within this distance is dropped
+  float const MAX_FORWARD_BACKWARD_ERROR = 1.0;
+
+  cv::Size const WIN_SIZE = cv::Size(15, 15);
+  int const MAX_LEVEL = 2;
+
+  // returns the fraction of points that were tracked reliably
+  double track_face(cv::Rect &face);
+
+public:
+  // starts tracking from this frame, e.g. after the faces were detected in it
+  void reset(cv::Mat const &gray);
+
+  // moves all faces from the last frame to this one. returns the lowest confidence of
+  // all faces in [0, 1]. faces that were lost are set to an empty rect
+  double track(cv::Mat const &gray, std::vector<cv::Rect> &faces);
+};
+
+#endif
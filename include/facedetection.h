@@ -5,18 +5,33 @@
 #include <vector>
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <iostream>
+#include <memory>
+#include <tuple>
 
 #include "opencv2/core.hpp"
-#include "opencv2/cuda.hpp"
 #include "opencv2/imgproc.hpp"
 #include "opencv2/objdetect.hpp"
 
+#ifdef WITH_CUDA
+#include "opencv2/cuda.hpp"
+#endif
+
+#include "face-tracker.h"
 #include "faces.h"
 #include "livestream.h"
+#include "metrics.h"
+#include "parallel-cascade.h"
 #include "util.h"
 
-template <typename TCascade = cv::cuda::CascadeClassifier_CUDA>
+#ifdef WITH_CUDA
+using DefaultCascade = cv::cuda::CascadeClassifier_CUDA;
+#else
+using DefaultCascade = cv::CascadeClassifier;
+#endif
+
+template <typename TCascade = DefaultCascade>
 class FaceDetection {
 
 private:
@@ -24,19 +39,90 @@ private:
   LiveStream &mStream;
   Faces &mFaces;
   TCascade mFaceCascade;
+  std::string mCascadeFile;
+  // cpu cascade only, when detecting on more than one thread
+  std::unique_ptr<ParallelCascade> mParallelCascade;
+
+  FaceTracker mTracker;
+  int mDetectInterval = DEFAULT_DETECT_INTERVAL;
+  int mFramesSinceDetection = 0;
+  uint64_t mLastSeq = 0;
+
+  int mFullScanInterval = 1;
+  int mScansSinceFullScan = 0;
+
+  double mAnalysisScale = 1;
+  double mScaleFactor = 1.2;
+
+  Histogram &mTickLatency = stage_latency("faces_tick");
+  Histogram &mConvertLatency = stage_latency("faces_convert");
+  Histogram &mDetectLatency = stage_latency("faces_detect");
+  Histogram &mTrackLatency = stage_latency("faces_track");
+  Histogram &mFullScanLatency = stage_latency("faces_full_scan");
+  Histogram &mRoiScanLatency = stage_latency("faces_roi_scan");
+  Histogram &mLatency = stage_latency("faces");
+  Gauge &mFaceCount = Metrics::instance().gauge("tdot_faces", "Number of faces currently tracked");
+  Counter &mFullScans = Metrics::instance().counter("tdot_face_scans_total",
+                                                    "Frames the face cascade was run on",
+                                                    "mode=\"full\"");
+  Counter &mRoiScans = Metrics::instance().counter("tdot_face_scans_total",
+                                                   "Frames the face cascade was run on",
+                                                   "mode=\"roi\"");
+  Counter &mTracks = Metrics::instance().counter("tdot_face_tracks_total",
+                                                 "Frames the faces were tracked in instead of detected");
 
 protected:
-  const double SCALE_FACTOR = 1.2;
   const int MIN_NEIGHBOURS = 4;
   const cv::Size MIN_SIZE = cv::Size(60, 60);
-
-  void do_facedetection(cv::Mat const &frame);
+  // below this fraction of reliably tracked points the cascade is run again
+  const double MIN_TRACK_CONFIDENCE = 0.5;
+  const std::chrono::milliseconds FRAME_WAIT = std::chrono::milliseconds(100);
+  // re-detection window around a known face, in face sizes added on every side
+  const double ROI_MARGIN = 0.5;
+  // scales searched in the window, relative to the size of the known face
+  const double ROI_MIN_SCALE = 0.7;
+  const double ROI_MAX_SCALE = 1.4;
+
+  // detects faces between min_size and max_size (empty for no limit) in image
+  void do_facedetection(cv::Mat const &image, cv::Size const &min_size, cv::Size const &max_size,
+                        std::vector<cv::Rect> &faces);
+  // runs the cascade on the whole frame or in windows around the known faces. gray may be
+  // scaled by scale relative to the frame, faces are stored in frame coordinates
+  void scan(cv::Mat const &gray, cv::Point2d const &scale);
+  // returns false if the faces could not be tracked reliably
+  bool track_faces(cv::Mat const &gray, cv::Point2d const &scale);
 
 public:
   FaceDetection(LiveStream &stream, Faces &faces, std::string const &face_cascade);
 
+  static int const DEFAULT_DETECT_INTERVAL = 5;
+
+  struct Stats {
+    uint64_t full_scans;
+    uint64_t roi_scans;
+    uint64_t tracked;
+  };
+
   bool isReady();
+  // detects on the next frame of the stream, waits for it up to FRAME_WAIT
   void detect();
+  void detect(FramePtr const &captured);
+
+  // run the cascade on every n-th frame and track the faces in between. 1 detects every frame
+  void setDetectInterval(int n);
+  // scan the whole frame on every n-th cascade run, or when no faces are known. in between
+  // only windows around the known faces are scanned. 1 always scans the whole frame
+  void setFullScanInterval(int n);
+  // splits the scales of the cpu cascade across n threads. returns false if the cascade
+  // could not be loaded for every thread
+  bool setDetectThreads(int n);
+  // detects and tracks on frames scaled by this factor, e.g. 0.5 for a quarter of the pixels
+  void setAnalysisScale(double scale);
+  // step between the scales searched by the cascade. larger steps are faster but may
+  // miss faces between two scales
+  void setScaleFactor(double factor);
+
+  Stats stats() const;
 };
 
 template <typename TCascade>
@@ -45,47 +131,209 @@ FaceDetection<TCascade>::FaceDetection(LiveStream &stream,
                                                std::string const &face_cascade)
                                                : mStream(stream),
                                                  mFaces(faces),
-                                                 mFaceCascade(face_cascade)
+                                                 mFaceCascade(face_cascade),
+                                                 mCascadeFile(face_cascade)
 {
 }
 
 template <typename TCascade>
-void FaceDetection<TCascade>::do_facedetection(cv::Mat const &frame)
+void FaceDetection<TCascade>::do_facedetection(cv::Mat const &image, cv::Size const &min_size,
+                                               cv::Size const &max_size, std::vector<cv::Rect> &faces)
 {
   std::cerr << "###" << std::endl;
   std::cerr << "Face detection not implemented!!!" << std::endl;
   std::cerr << "###" << std::endl;
 }
 
+#ifdef WITH_CUDA
 template <>
-void FaceDetection<cv::cuda::CascadeClassifier_CUDA>::do_facedetection(cv::Mat const &frame)
+void FaceDetection<cv::cuda::CascadeClassifier_CUDA>::do_facedetection(cv::Mat const &image,
+                                                                      cv::Size const &min_size,
+                                                                      cv::Size const &max_size,
+                                                                      std::vector<cv::Rect> &faces)
 {
   cv::Mat h_faces;
   cv::cuda::GpuMat d_frame, d_faces;
-  d_frame.upload(frame);
+  d_frame.upload(image);
 
   int n_detected = mFaceCascade.detectMultiScale(d_frame, d_faces,
-                                                 SCALE_FACTOR, MIN_NEIGHBOURS, MIN_SIZE);
+                                                 mScaleFactor, MIN_NEIGHBOURS, min_size);
+  if (n_detected <= 0) {
+    return;
+  }
   
   d_faces.colRange(0, n_detected).download(h_faces);
   cv::Rect *prect = h_faces.ptr<cv::Rect>();
 
-  std::unique_lock<std::mutex> l(mFaces.getMutex());
+  // the cuda cascade has no maximum size
   for (int i = 0; i < n_detected; i++) {
-    mFaces.addFace(prect[i]);
+    if ((max_size.area() == 0) ||
+        ((prect[i].width <= max_size.width) && (prect[i].height <= max_size.height))) {
+      faces.push_back(prect[i]);
+    }
   }
 }
+#endif
 
 template <>
-void FaceDetection<cv::CascadeClassifier>::do_facedetection(cv::Mat const &frame)
+void FaceDetection<cv::CascadeClassifier>::do_facedetection(cv::Mat const &image,
+                                                            cv::Size const &min_size,
+                                                            cv::Size const &max_size,
+                                                            std::vector<cv::Rect> &faces)
+{
+  if (mParallelCascade) {
+    mParallelCascade->detectMultiScale(image, faces, mScaleFactor, MIN_NEIGHBOURS, min_size, max_size);
+  } else {
+    mFaceCascade.detectMultiScale(image, faces, mScaleFactor, MIN_NEIGHBOURS, 0, min_size, max_size);
+  }
+
+  // candidates are found in parallel inside and outside of opencv, fix the order of the faces
+  std::sort(faces.begin(), faces.end(), [](cv::Rect const &a, cv::Rect const &b)
+            {
+              return std::make_tuple(a.y, a.x, a.height, a.width)
+                     < std::make_tuple(b.y, b.x, b.height, b.width);
+            });
+}
+
+template <typename TCascade>
+void FaceDetection<TCascade>::scan(cv::Mat const &frame, cv::Point2d const &scale)
+{
+  std::vector<cv::Rect> known;
+  for (Face const &face : *mFaces.snapshot()) {
+    known.push_back(scale_rect(face.rect, scale.x, scale.y));
+  }
+  // the minimum size of a face in the frame
+  cv::Size const min_face(cvRound(MIN_SIZE.width * scale.x), cvRound(MIN_SIZE.height * scale.y));
+
+  double start = (double) cv::getTickCount();
+
+  bool const full_scan = known.empty() || (mScansSinceFullScan + 1 >= mFullScanInterval);
+  std::vector<cv::Rect> detected;
+
+  if (full_scan) {
+    do_facedetection(frame, min_face, cv::Size(), detected);
+    mScansSinceFullScan = 0;
+  } else {
+    cv::Rect const bounds(0, 0, frame.cols, frame.rows);
+
+    for (cv::Rect const &face : known) {
+      int const dx = face.width * ROI_MARGIN;
+      int const dy = face.height * ROI_MARGIN;
+      cv::Rect const roi = cv::Rect(face.x - dx, face.y - dy, face.width + 2 * dx, face.height + 2 * dy)
+                           & bounds;
+
+      cv::Size const min_size(std::max<int>(face.width * ROI_MIN_SCALE, min_face.width),
+                              std::max<int>(face.height * ROI_MIN_SCALE, min_face.height));
+      cv::Size const max_size(face.width * ROI_MAX_SCALE, face.height * ROI_MAX_SCALE);
+      if ((roi.width < min_size.width) || (roi.height < min_size.height)) {
+        continue;
+      }
+
+      std::vector<cv::Rect> found;
+      do_facedetection(frame(roi), min_size, max_size, found);
+      for (cv::Rect &f : found) {
+        detected.push_back(f + roi.tl());
+      }
+    }
+    mScansSinceFullScan++;
+  }
+
+  double const elapsed = ((double) cv::getTickCount() - start) / cv::getTickFrequency();
+  if (full_scan) {
+    mFullScanLatency.observe(elapsed);
+    mFullScans.inc();
+  } else {
+    mRoiScanLatency.observe(elapsed);
+    mRoiScans.inc();
+  }
+
+  for (cv::Rect &face : detected) {
+    face = scale_rect(face, 1 / scale.x, 1 / scale.y);
+  }
+  mFaces.addFaces(detected);
+}
+
+template <typename TCascade>
+bool FaceDetection<TCascade>::track_faces(cv::Mat const &frame, cv::Point2d const &scale)
 {
+  FacesSnapshot known = mFaces.snapshot();
   std::vector<cv::Rect> faces;
-  mFaceCascade.detectMultiScale(frame, faces, SCALE_FACTOR, MIN_NEIGHBOURS, 0, MIN_SIZE);
+  for (Face const &face : *known) {
+    faces.push_back(scale_rect(face.rect, scale.x, scale.y));
+  }
 
-  std::unique_lock<std::mutex> l(mFaces.getMutex());
-  for (cv::Rect &face : faces) {
-    mFaces.addFace(face);
+  if (mTracker.track(frame, faces) < MIN_TRACK_CONFIDENCE) {
+    return false;
   }
+
+  FaceList moved;
+  for (size_t i = 0; i < faces.size(); i++) {
+    if (faces[i].area() > 0) {
+      Face face = { (*known)[i].id, scale_rect(faces[i], 1 / scale.x, 1 / scale.y) };
+      moved.push_back(face);
+    }
+  }
+  mFaces.updateFaces(moved);
+  return true;
+}
+
+template <typename TCascade>
+void FaceDetection<TCascade>::setAnalysisScale(double scale)
+{
+  mAnalysisScale = std::min(std::max(scale, 0.05), 1.0);
+  // the tracker holds a frame of the old size, detect on the next frame
+  mFramesSinceDetection = mDetectInterval;
+}
+
+template <typename TCascade>
+void FaceDetection<TCascade>::setScaleFactor(double factor)
+{
+  mScaleFactor = std::max(factor, 1.01);
+}
+
+template <typename TCascade>
+void FaceDetection<TCascade>::setDetectInterval(int n)
+{
+  mDetectInterval = std::max(n, 1);
+  mFramesSinceDetection = 0;
+}
+
+template <typename TCascade>
+void FaceDetection<TCascade>::setFullScanInterval(int n)
+{
+  mFullScanInterval = std::max(n, 1);
+  mScansSinceFullScan = 0;
+}
+
+template <typename TCascade>
+bool FaceDetection<TCascade>::setDetectThreads(int n)
+{
+  std::cerr << "parallel detection is only supported by the cpu cascade" << std::endl;
+  return n <= 1;
+}
+
+template <>
+bool FaceDetection<cv::CascadeClassifier>::setDetectThreads(int n)
+{
+  if (n <= 1) {
+    mParallelCascade.reset();
+    return true;
+  }
+
+  mParallelCascade.reset(new ParallelCascade(mCascadeFile, n));
+  if (mParallelCascade->empty()) {
+    std::cerr << "loading " << mCascadeFile << " for " << n << " threads failed" << std::endl;
+    mParallelCascade.reset();
+    return false;
+  }
+  return true;
+}
+
+template <typename TCascade>
+typename FaceDetection<TCascade>::Stats FaceDetection<TCascade>::stats() const
+{
+  Stats stats = { mFullScans.value(), mRoiScans.value(), mTracks.value() };
+  return stats;
 }
 
 template <typename TCascade>
@@ -96,51 +344,72 @@ bool FaceDetection<TCascade>::isReady()
 
 template <typename TCascade>
 void FaceDetection<TCascade>::detect()
+{
+  // sleep until there is something new to look at
+  detect(mStream.waitForFrame(mLastSeq, FRAME_WAIT));
+}
+
+template <typename TCascade>
+void FaceDetection<TCascade>::detect(FramePtr const &captured)
 {
   assert(isReady());
 
   cv::Mat frame;
-  std::vector<cv::Rect> faces;
 
-  double start, mutex_locked, tick_done, got_frame, detection_done;
+  double start, tick_done, got_frame, detection_done;
 
   start = (double) cv::getTickCount();
 
-  mutex_locked = (double) cv::getTickCount();
+  if (!captured) {
+    return;
+  }
+
+  // a frame that was already handled has no new faces. detecting again would also age
+  // the faces without a chance to find them again
+  if (captured->seq == mLastSeq) {
+    return;
+  }
+  mLastSeq = captured->seq;
+
+  bool const tracking = mDetectInterval > 1;
 
   // update ttl of all faces
   mFaces.tick();
 
   tick_done = (double) cv::getTickCount();
 
-  mStream.getFrame(frame);
-  cv::cvtColor(frame, frame, cv::COLOR_BGR2GRAY);
+  // shared with the other stages, read only
+  frame = captured->scaled_gray(mAnalysisScale);
+  cv::Point2d const scale((double) frame.cols / captured->image.cols,
+                          (double) frame.rows / captured->image.rows);
 
   got_frame = (double) cv::getTickCount();
 
-  do_facedetection(frame);
+  bool tracked = false;
+  if (tracking && (mFramesSinceDetection + 1 < mDetectInterval)) {
+    tracked = track_faces(frame, scale);
+  }
+
+  if (tracked) {
+    mFramesSinceDetection++;
+    mTracks.inc();
+  } else {
+    scan(frame, scale);
+    if (tracking) {
+      mTracker.reset(frame);
+    }
+    mFramesSinceDetection = 0;
+  }
 
   detection_done = (double) cv::getTickCount();
 
-  std::string debug_window_name = "Debug Window";
-  cv::Mat debug = cv::Mat::zeros(frame.rows, frame.cols, CV_8UC3);
-  double mutex = (mutex_locked - start) / cv::getTickFrequency();
-  double tick = (tick_done - mutex_locked) / cv::getTickFrequency();
-  double frame_t = (got_frame - tick_done) / cv::getTickFrequency();
-  double detection = (detection_done - got_frame) / cv::getTickFrequency();
-  double total = (detection_done - start) / cv::getTickFrequency();
-
-  std::vector<PrintableTime> times =
-  {
-    { "mutex:     ", &mutex },
-    { "tick;      ", &tick },
-    { "get frame: ", &frame_t },
-    { "detection: ", &detection },
-    { "total:     ", &total },
-  };
+  double const f = cv::getTickFrequency();
+  mTickLatency.observe((tick_done - start) / f);
+  mConvertLatency.observe((got_frame - tick_done) / f);
+  (tracked ? mTrackLatency : mDetectLatency).observe((detection_done - got_frame) / f);
+  mLatency.observe((detection_done - start) / f);
 
-  print_times(debug, cv::Point(50, 50), times);
-  //cv::imshow(debug_window_name, debug);
+  mFaceCount.set(mFaces.snapshot()->size());
 }
 
 #endif
@@ -1,32 +1,67 @@
 #ifndef FACES_H_INCLUDED
 #define FACES_H_INCLUDED
 
+#include <cstdint>
+#include <memory>
 #include <mutex>
+#include <vector>
 
 #include "opencv2/core.hpp"
 
+struct Face {
+  // stays the same while the face is tracked, never reused
+  uint64_t id;
+  cv::Rect rect;
+};
+
+using FaceList = std::vector<Face>;
+// immutable list of the faces at one point in time
+using FacesSnapshot = std::shared_ptr<FaceList const>;
+
+/*
+ * Track table of the faces in the frame. Detections are assigned to the track they
+ * overlap most, measured as intersection over union; the candidates are looked up in a
+ * grid of cells so crowded frames do not compare every detection with every track.
+ *
+ * Every change publishes a new snapshot. Readers take the latest one without locking
+ * and keep it as long as they like, the writer never changes a published list.
+ */
 class Faces {
 
 private:
-  struct FaceEntry {
-    cv::Rect face;
+  struct Track {
+    Face face;
     int ttl;
   };
 
-  std::mutex mMutex;
-  std::vector<FaceEntry> mFaces;
+  // serializes the writers, readers never take it
+  std::mutex mWriteMutex;
+  std::vector<Track> mTracks;
+  uint64_t mNextId = 1;
+
+  // accessed with std::atomic_load and std::atomic_store only
+  FacesSnapshot mSnapshot;
 
   int const DEFAULT_TTL = 3;
+  // a detection with less overlap than this starts a new track
+  double const MIN_IOU = 0.3;
+
+  void publish();
 
 public:
+  Faces();
 
-  void addFace(cv::Rect &face);
+  // assigns every detection to the track it overlaps most. the others start new tracks,
+  // unless they overlap a detection that was assigned, and tracks overlapping an assigned
+  // detection are dropped as duplicates
+  void addFaces(std::vector<cv::Rect> const &detections);
+  // moves the tracks with these ids to where they were tracked to
+  void updateFaces(FaceList const &faces);
 
+  // ages all tracks and drops the ones that were not seen for a while
   void tick();
 
-  std::mutex &getMutex();
-  std::vector<cv::Rect> getFaces();
-
+  FacesSnapshot snapshot() const;
 };
 
 #endif
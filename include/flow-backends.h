@@ -0,0 +1,81 @@
+#ifndef FLOW_BACKENDS_H_INCLUDED
+#define FLOW_BACKENDS_H_INCLUDED
+
+#include "opencv2/core.hpp"
+
+#ifdef WITH_CUDA
+#include "opencv2/cuda.hpp"
+#include "opencv2/cudaoptflow.hpp"
+#endif
+
+// parameters of the farneback dense optical flow, shared by all backends
+struct FarnebackParams {
+  int numLevels = 1;          // number of pyramid layers including initial
+  double pyrScale = 0.5;      // scale for pyramids. 0.5: next layer is twice smaller
+  bool fastPyramids = false;
+  int winSize = 13;           // averaging window size
+  int numIters = 1;           // iterations per pyramid level
+  int polyN = 7;              // size of pixel neighborhood. usally 5 or 7
+  double polySigma = 1.5;     // standard deviation for gaussian usually 1.1 or 1.5
+  int flags = 0;
+};
+
+/*
+ * Backends compute the dense flow between the last two loaded grayscale frames
+ * and are used as template parameter of OpticalFlow:
+ *
+ *   void setParams(FarnebackParams const &params);
+ *   void load(cv::Mat const &gray);
+ *   void calc(cv::Mat &flowx, cv::Mat &flowy, double &calc_time_ms, double &dl_time_ms);
+ */
+
+#ifdef WITH_CUDA
+class CudaFarnebackFlow {
+
+private:
+  cv::cuda::Stream mCudaStream;
+  cv::cuda::FarnebackOpticalFlow mFarneback;
+
+  // pointers to the GpuMats are used to allow fast swapping of last and new images
+  cv::cuda::GpuMat mGpuImg1;
+  cv::cuda::GpuMat mGpuImg2;
+  cv::cuda::GpuMat *mNowGpuImg, *mLastGpuImg;
+
+public:
+  CudaFarnebackFlow();
+
+  void setParams(FarnebackParams const &params);
+  void load(cv::Mat const &gray);
+  void calc(cv::Mat &flowx, cv::Mat &flowy, double &calc_time_ms, double &dl_time_ms);
+};
+#endif
+
+// splits the frame into horizontal stripes that are processed in parallel. every stripe
+// is extended by the rows influencing its flow on every pyramid level, which keeps the
+// seams between the stripes small. the flow is not identical to the one of the whole
+// frame, e.g. where an object moves further than the margin accounts for
+class CpuFarnebackFlow {
+
+private:
+  FarnebackParams mParams;
+  int mThreads;
+
+  cv::Mat mImg1;
+  cv::Mat mImg2;
+  cv::Mat *mNowImg, *mLastImg;
+
+  // pyramid levels calcOpticalFlowFarneback computes on top of an image of this size
+  int pyramid_levels(cv::Size const &size) const;
+  int stripe_margin(int levels) const;
+
+public:
+  // threads <= 0 uses one thread per cpu
+  CpuFarnebackFlow(int threads = 0);
+
+  void setThreads(int threads);
+  void setParams(FarnebackParams const &params);
+  void load(cv::Mat const &gray);
+  void calc(cv::Mat &flowx, cv::Mat &flowy, double &calc_time_ms, double &dl_time_ms);
+};
+
+#endif
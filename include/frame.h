@@ -0,0 +1,100 @@
+#ifndef FRAME_H_INCLUDED
+#define FRAME_H_INCLUDED
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "opencv2/core.hpp"
+
+#include "metrics.h"
+
+/*
+ * Grayscale and downscaled copies of a frame, computed on first use and shared by
+ * all stages. The returned images are shared read-only, just like the frame.
+ */
+class DerivedImages {
+
+private:
+  struct Entry {
+    std::once_flag once;
+    cv::Mat image;
+  };
+
+  // pyramid level 0 is the grayscale frame, every further level is half the size
+  static int const MAX_LEVELS = 8;
+  std::shared_ptr<Entry> mLevels[MAX_LEVELS];
+  // other scales, keyed by the scale in thousandths
+  std::vector<std::pair<int, std::shared_ptr<Entry>>> mScaled;
+  std::mutex mMutex;
+
+  Counter &mHits = Metrics::instance().counter("tdot_frame_cache_hits_total",
+                                               "Derived images of a frame reused instead of converted again");
+  Counter &mMisses = Metrics::instance().counter("tdot_frame_cache_misses_total",
+                                                 "Derived images of a frame converted on first use");
+
+  std::shared_ptr<Entry> entry(std::shared_ptr<Entry> &slot);
+  // computes the image of the entry exactly once, other callers wait for it
+  template <typename TFun>
+  cv::Mat get(std::shared_ptr<Entry> const &entry, TFun compute);
+
+public:
+  cv::Mat gray(cv::Mat const &image);
+  // gaussian pyramid of the grayscale frame
+  cv::Mat pyramid(cv::Mat const &image, int level);
+  // grayscale frame scaled by scale. powers of 1/2 are pyramid levels
+  cv::Mat scaled(cv::Mat const &image, double scale);
+
+  // drops all images, before the frame is reused for another capture
+  void clear();
+};
+
+// a captured frame as published by LiveStream. frames are immutable once published,
+// consumers share them by reference and must not write into image. the buffer of image
+// is reused once the last FramePtr is dropped, so no cv::Mat header of it may outlive
+// the FramePtr it came from
+struct Frame {
+  cv::Mat image;
+  // increases by one for every published frame, starting at 1
+  uint64_t seq = 0;
+  // time of publication
+  std::chrono::steady_clock::time_point timestamp;
+  // time spent reading, decoding and scaling the frame before its publication
+  double capture_ms = 0;
+
+  mutable DerivedImages derived;
+
+  cv::Mat gray() const { return derived.gray(image); }
+  cv::Mat scaled_gray(double scale) const { return derived.scaled(image, scale); }
+};
+
+using FramePtr = std::shared_ptr<Frame const>;
+
+/*
+ * Frame buffers recycled by the capture. The shared_ptr handed out returns its frame
+ * to the free list once the last reference is dropped, under the lock of the list, so
+ * everything the readers did with the frame happens before the capture writes it again.
+ * The free list outlives the pool as long as frames are referenced.
+ */
+class FramePool {
+
+private:
+  struct FreeList {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Frame>> frames;
+    size_t capacity;
+  };
+
+  std::shared_ptr<FreeList> mFree;
+
+public:
+  // keeps at most capacity free frames, further returned frames are deleted
+  FramePool(size_t capacity);
+
+  // a free frame, or a newly allocated one when all are in use. allocated tells which
+  std::shared_ptr<Frame> acquire(bool &allocated);
+};
+
+#endif
@@ -5,45 +5,151 @@
 #include "opencv2/highgui/highgui.hpp"
 
 #include "alpha-image.h"
+#include "faces.h"
+#include "frame.h"
+#include "metrics.h"
+#include "shm-ring.h"
+#include "util.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct PlaybackOptions {
+  // sleep between frames to play file sources at their native (or given) rate
+  bool paced = true;
+  // start over when the end of a file source is reached
+  bool loop = false;
+  // playback rate of file sources. <= 0 uses the rate stored in the video file
+  double fps = 0;
+};
 
 class LiveStream {
 
 private:
+  enum SourceType {
+    SOURCE_CAMERA,
+    SOURCE_VIDEO_FILE,
+    SOURCE_IMAGE_SEQUENCE,
+  };
+
+  SourceType mSourceType = SOURCE_CAMERA;
+  PlaybackOptions mPlayback;
+
   cv::VideoCapture mCamera;
   int mStreamWidth = 0;
   int mStreamHeight = 0;
 
-  cv::Mat mCurrentFrame;
+  std::vector<std::string> mImageFiles;
+  size_t mNextImage = 0;
+  std::atomic<bool> mEndOfStream;
+
+  std::thread mCaptureThread;
+  std::atomic<bool> mStopCapture;
+  RateCounter mCaptureRate;
+
+  // signalled whenever a frame is published or the input ends
+  mutable std::mutex mFrameMutex;
+  mutable std::condition_variable mFrameEvent;
+  void notifyFrame();
+
+  Histogram &mCaptureLatency = stage_latency("capture");
+  Histogram &mCompositeLatency = stage_latency("composite");
+  Counter &mFramesCaptured = Metrics::instance().counter("tdot_frames_captured_total",
+                                                         "Frames published by the capture");
+  Counter &mFrameAllocations = Metrics::instance().counter("tdot_frame_allocations_total",
+                                                           "Frame buffers allocated because all pooled ones were in use");
+
+  std::chrono::nanoseconds mFramePeriod;
+  std::chrono::steady_clock::time_point mNextFrameTime;
+
+  // latest published frame. only accessed through std::atomic_load/atomic_store, so
+  // readers never wait for the capture and the capture never waits for readers
+  std::shared_ptr<Frame const> mLatestFrame;
+  uint64_t mFrameSeq = 0;
+
+  // frame buffers recycled by the capture once no reader references them anymore
+  static size_t const MAX_FRAME_POOL = 8;
+  FramePool mFramePool;
+  cv::Mat mRawFrame;
+
+  // copies of the published frames for other processes, written by the capture
+  ShmRingWriter mShmRing;
+  Faces const *mExportFaces = nullptr;
+  Counter &mFramesExported = Metrics::instance().counter("tdot_shm_frames_exported_total",
+                                                         "Frames written to the shared memory ring");
+
   cv::Mat mOverlay;
   cv::Mat mOverlayAlpha;
+  // dirty rectangles: areas of the overlay written to since the last reset. they never
+  // intersect, so every overlay pixel is cleared and composited at most once
+  std::vector<cv::Rect> mOverlayRects;
+  std::vector<uchar> mBlendAlphaRow;
 
   int const DEFAULT_TTL = 30;
   int mOverlayTTL;
 
-  mutable std::mutex mFrameMutex;
   mutable std::recursive_mutex mOverlayMutex;
 
   bool openCamera(int num, int width, int height);
-  void getCurrentFrame();
+  bool openFile(std::string const &path, int width, int height);
+  bool openImageDirectory(std::string const &path, int width, int height);
+  void initialize();
+
+  bool readFromSource(cv::Mat &frame);
+  void waitForFrameTime();
+  std::shared_ptr<Frame> acquireFrameBuffer();
+  bool captureFrame();
+  void captureLoop();
+  void exportFrame(Frame const &frame);
 
 public:
 
   LiveStream(int camNum);
   LiveStream(int camNum, int width, int height);
+  // source is either a video file, an image sequence pattern (e.g. img_%04d.png)
+  // or a directory containing images, which are played back in lexical order
+  LiveStream(std::string const &source, int width, int height,
+             PlaybackOptions const &playback = PlaybackOptions());
 
   virtual ~LiveStream();
 
   bool isOpened() const;
+  bool isLive() const;
+  bool finished() const;
   int width() const;
   int height() const;
 
-  void getFrame(cv::Mat &frame);
-  void nextFrame(cv::Mat &frame);
+  // starts a thread capturing and publishing frames at the rate of the source
+  void start();
+  void stop();
+  RateCounter const &captureRate() const;
+
+  // latest published frame without copying it. never blocks
+  FramePtr getFrame() const;
+  // waits until a frame newer than seq is published, the input ends or the timeout
+  // expires. returns the latest frame, which is only newer than seq in the first case
+  FramePtr waitForFrame(uint64_t seq, std::chrono::milliseconds timeout) const;
+  // captures and publishes a new frame. returns nullptr at the end of the input.
+  // must only be called from a single thread and not while the capture thread runs
+  FramePtr nextFrame();
+
+  // also writes every frame into the shared memory ring name, e.g. "/tdot-frames", for
+  // other processes. see shm-ring.h for reading it. must not be called while capturing
+  bool exportFrames(std::string const &name, int slots);
+  // the faces written along with the frames. must not be called while capturing
+  void setExportFaces(Faces const *faces);
 
   std::recursive_mutex &getOverlayMutex();
+  // clears the dirty rectangles of the overlay
   void resetOverlay();
+  std::vector<cv::Rect> overlayRects() const;
   void addImageToOverlay(AlphaImage const &image, int width, int x, int y);
+  // alpha blends the overlay onto image, only visiting the areas hats were written to
   void applyOverlay(cv::Mat &image);
 };
 
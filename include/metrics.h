@@ -0,0 +1,150 @@
+#ifndef METRICS_H_INCLUDED
+#define METRICS_H_INCLUDED
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+#include "opencv2/core.hpp"
+
+/*
+ * Process wide registry of counters, gauges and latency histograms. Registering
+ * takes a lock and should be done once, e.g. in a constructor. Updating a metric
+ * is lock free and can be done from any thread.
+ */
+
+class Metric {
+public:
+  virtual ~Metric() { }
+  virtual void write(std::ostream &out, std::string const &name, std::string const &labels) const = 0;
+};
+
+class Counter : public Metric {
+
+private:
+  std::atomic<uint64_t> mValue;
+
+public:
+  Counter() : mValue(0) { }
+
+  void inc(uint64_t n = 1) { mValue.fetch_add(n, std::memory_order_relaxed); }
+  uint64_t value() const { return mValue.load(std::memory_order_relaxed); }
+
+  void write(std::ostream &out, std::string const &name, std::string const &labels) const;
+};
+
+class Gauge : public Metric {
+
+private:
+  std::atomic<double> mValue;
+
+public:
+  Gauge() : mValue(0) { }
+
+  void set(double value) { mValue.store(value, std::memory_order_relaxed); }
+  double value() const { return mValue.load(std::memory_order_relaxed); }
+
+  void write(std::ostream &out, std::string const &name, std::string const &labels) const;
+};
+
+// latency histogram in seconds with fixed buckets from 0.5ms to 1s
+class Histogram : public Metric {
+
+private:
+  static int const BUCKETS = 11;
+  static double const BOUNDS[BUCKETS];
+
+  // not cumulative, the last bucket counts everything above the largest bound
+  std::atomic<uint64_t> mBuckets[BUCKETS + 1];
+  std::atomic<uint64_t> mCount;
+  std::atomic<double> mSum;
+  std::atomic<double> mLast;
+
+public:
+  Histogram();
+
+  void observe(double seconds);
+
+  uint64_t count() const { return mCount.load(std::memory_order_relaxed); }
+  // sum of all observations in seconds
+  double sum() const { return mSum.load(std::memory_order_relaxed); }
+  // the most recent observation, e.g. for printing onto a frame
+  double last() const { return mLast.load(std::memory_order_relaxed); }
+
+  void write(std::ostream &out, std::string const &name, std::string const &labels) const;
+};
+
+class Metrics {
+
+private:
+  struct Family {
+    std::string help;
+    std::string type;
+    // keyed by the label string, e.g. stage="faces"
+    std::map<std::string, std::unique_ptr<Metric>> series;
+  };
+
+  std::map<std::string, Family> mFamilies;
+  mutable std::mutex mMutex;
+
+  template <typename TMetric>
+  TMetric &get(std::string const &name, std::string const &type,
+               std::string const &help, std::string const &labels);
+
+public:
+  static Metrics &instance();
+
+  Counter &counter(std::string const &name, std::string const &help, std::string const &labels = "");
+  Gauge &gauge(std::string const &name, std::string const &help, std::string const &labels = "");
+  Histogram &histogram(std::string const &name, std::string const &help, std::string const &labels = "");
+
+  // all metrics in the prometheus text exposition format
+  std::string snapshot() const;
+};
+
+// latency histogram of a pipeline stage, exported as tdot_stage_latency_seconds{stage="..."}
+Histogram &stage_latency(std::string const &stage);
+
+// observes the time from its construction to its destruction
+class ScopedTimer {
+
+private:
+  Histogram &mHistogram;
+  int64_t mStart;
+
+public:
+  ScopedTimer(Histogram &histogram) : mHistogram(histogram), mStart(cv::getTickCount()) { }
+  ~ScopedTimer() { mHistogram.observe((cv::getTickCount() - mStart) / cv::getTickFrequency()); }
+};
+
+// periodically writes the metrics snapshot to a file, or serves it on a unix socket
+// to every client that connects
+class MetricsExporter {
+
+private:
+  std::string mFile;
+  std::string mSocket;
+  int mIntervalMs;
+
+  std::thread mThread;
+  std::atomic<bool> mStop;
+
+  void write_file();
+  void export_loop();
+  void serve_loop(int server);
+
+public:
+  MetricsExporter();
+  ~MetricsExporter();
+
+  bool startFile(std::string const &file, int interval_ms);
+  bool startSocket(std::string const &socket);
+  void stop();
+};
+
+#endif
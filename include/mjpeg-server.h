@@ -0,0 +1,98 @@
+#ifndef MJPEG_SERVER_H_INCLUDED
+#define MJPEG_SERVER_H_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+#include "thread-safe-mat.h"
+
+/*
+ * Small http server streaming images as multipart mjpeg to browsers or e.g.
+ * `curl http://127.0.0.1:8080/live`. Every new version of a stream is encoded once and
+ * the same buffer is sent to all of its clients. The sockets never block: a client still
+ * busy with the last frame skips the new one, and a client that takes too long for a
+ * frame is disconnected.
+ */
+class MjpegServer {
+
+private:
+  using Buffer = std::shared_ptr<std::vector<uchar> const>;
+
+  struct Stream {
+    std::string path;
+    ThreadSafeMat const *source;
+    uint64_t version;
+    // the last encoded frame including its multipart headers
+    Buffer part;
+  };
+
+  struct Client {
+    int fd;
+    std::string request;
+    // index into mStreams, -1 while the request is read
+    int stream;
+    // version of the stream sent last, 0 before the first frame
+    uint64_t version;
+    // buffer being sent and how much of it is sent already
+    Buffer sending;
+    size_t sent;
+    // start of the current buffer, or of the connection while the request is read
+    std::chrono::steady_clock::time_point sending_since;
+    // close once the buffer is sent, for everything but streams
+    bool close_when_sent;
+  };
+
+  std::vector<Stream> mStreams;
+  int mQuality;
+
+  std::thread mThread;
+  std::atomic<bool> mStop;
+
+  Gauge &mClients;
+  Counter &mFramesSent;
+  Counter &mFramesSkipped;
+  Counter &mClientsDropped;
+  Counter &mClientsRejected;
+  Histogram &mEncodeLatency;
+
+  // streams are checked for new versions at least this often
+  int const POLL_INTERVAL_MS = 10;
+  // a client that needs longer for one frame, or to send its request, is disconnected
+  double const CLIENT_TIMEOUT_S = 2;
+  size_t const MAX_REQUEST = 4096;
+  // further connections are turned away
+  size_t const MAX_CLIENTS = 16;
+
+  void serve_loop(int server);
+  // returns false if the client has to be closed
+  bool read_request(Client &client);
+  bool send_pending(Client &client);
+  void respond(Client &client, std::string const &status, std::string const &headers,
+               std::string const &body, bool close_when_sent);
+  // returns true if there was a new image
+  bool encode(Stream &stream);
+
+public:
+  MjpegServer();
+  ~MjpegServer();
+
+  MjpegServer(MjpegServer const &) = delete;
+  MjpegServer &operator=(MjpegServer const &) = delete;
+
+  // serves the images of source at path, e.g. "/live". must be called before start
+  void addStream(std::string const &path, ThreadSafeMat const &source);
+  // jpeg quality from 0 to 100, default 80
+  void setQuality(int quality);
+
+  // the default address keeps the streams on this machine
+  bool start(int port, std::string const &address = "127.0.0.1");
+  void stop();
+};
+
+#endif
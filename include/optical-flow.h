@@ -1,15 +1,33 @@
 #ifndef OPTICAL_FLOW_H_INCLUDED
 #define OPTICAL_FLOW_H_INCLUDED
 
+#include <atomic>
+#include <chrono>
 #include <map>
+#include <vector>
 
-#include "opencv2/cuda.hpp"
-#include "opencv2/cudaoptflow.hpp"
-
+#include "direction-grid.h"
 #include "faces.h"
+#include "flow-backends.h"
 #include "livestream.h"
+#include "metrics.h"
 #include "thread-safe-mat.h"
 
+#ifdef WITH_CUDA
+using DefaultFlowBackend = CudaFarnebackFlow;
+#else
+using DefaultFlowBackend = CpuFarnebackFlow;
+#endif
+
+// flow vector at one point of the sample grid the visualizations are drawn from
+struct FlowSample {
+  cv::Point pos;
+  cv::Point2f flow;
+};
+
+using FlowSamples = std::vector<FlowSample>;
+
+template <typename TFlow = DefaultFlowBackend>
 class OpticalFlow {
 private:
   LiveStream &mStream;
@@ -17,22 +35,49 @@ private:
   ThreadSafeMat *mVisualizationImage;
   Faces *mFaces = nullptr;
 
-  cv::cuda::Stream mCudaStream;
-  cv::cuda::FarnebackOpticalFlow mFarneback;
-
-  // pointers to the GpuMats are used to allow fast swapping of last and new images
-  cv::cuda::GpuMat mGpuImg1;
-  cv::cuda::GpuMat mGpuImg2;
-  cv::cuda::GpuMat *mNowGpuImg, *mLastGpuImg;
-
-  static int const DIRECTION_UNDEFINED = 0;
-  static int const DIRECTION_APPROACHING = 1;
-  static int const DIRECTION_DISTANCING = 2;
+  TFlow mFlow;
+  // the backend has not seen the last frame, initially or after the sparse mode was used
+  bool mFlowStale = true;
+
+  cv::Mat mLastGray;
+  cv::Mat mNowGray;
+  // frame mNowGray was taken from
+  uint64_t mNowSeq = 0;
+  std::vector<cv::Mat> mLastPyramid;
+  std::vector<cv::Mat> mNowPyramid;
+
+  // distance of the flow samples in x and y
+  int mSampleStride = 10;
+  // directions of the samples, counted per block or face by the visualizations
+  DirectionGrid mDirections;
+  // mode the flow is calculated in, only accessed by the stage
+  bool mSparse = false;
+  // mode requested by setSparse and toggle_mode, applied by the stage before it runs
+  std::atomic<bool> mSparseRequested;
+  // size of the analyzed gray images relative to the frames
+  double mScale = 1;
+
+  Histogram &mUploadLatency = stage_latency("flow_upload");
+  Histogram &mCalcLatency = stage_latency("flow_calc");
+  Histogram &mDownloadLatency = stage_latency("flow_download");
+  Histogram &mVisualizeLatency = stage_latency("flow_visualize");
+  Histogram &mLatency = stage_latency("flow");
+
+  std::chrono::milliseconds const FRAME_WAIT = std::chrono::milliseconds(100);
+
+  cv::Size const LK_WIN_SIZE = cv::Size(21, 21);
+  int const LK_MAX_LEVEL = 3;
+
+  static int const DIRECTION_UNDEFINED = DirectionGrid::UNDEFINED;
+  static int const DIRECTION_APPROACHING = DirectionGrid::APPROACHING;
+  static int const DIRECTION_DISTANCING = DirectionGrid::DISTANCING;
 
   int get_direction_of_pixel(bool lower_half, cv::Point const &p1, cv::Point const & p2);
 
-  void load_new_frame();
-  void use_farneback(cv::Mat &flowx, cv::Mat &flowy, double &calc_time, double &dl_time);
+  void load_new_frame(FramePtr const &frame);
+  void calc_dense_flow(FlowSamples &samples, double &ul_time_ms,
+                       double &calc_time_ms, double &dl_time_ms);
+  void calc_sparse_flow(FlowSamples &samples, double &calc_time_ms);
 
   enum VisualizationType {
     OPTICAL_FLOW_VISUALIZATION_FACES = 0,
@@ -41,24 +86,41 @@ private:
     OPTICAL_FLOW_VISUALIZATION_LAST_ENTRY
   };
 
-  static std::map<OpticalFlow::VisualizationType, std::string> mVisualizationNames; 
+  static std::map<VisualizationType, std::string> mVisualizationNames; 
 
   VisualizationType mVisualization = OPTICAL_FLOW_VISUALIZATION_ARROWS;
 
   template <typename TFun>
-  void visualize_optical_flow(cv::Mat const &flowx, cv::Mat const &flowy, TFun pixel_callback);
-  cv::Mat visualize_optical_flow_arrows(cv::Mat const &flowx, cv::Mat const &flowy);
-  cv::Mat visualize_optical_flow_blocks(cv::Mat const &flowx, cv::Mat const &flowy);
-  cv::Mat visualize_optical_flow_faces(cv::Mat const &flowx, cv::Mat const &flowy);
+  void visualize_optical_flow(FlowSamples const &samples, TFun pixel_callback);
+  // sets the direction of every moving sample in mDirections
+  void count_directions(FlowSamples const &samples);
+  cv::Mat visualize_optical_flow_arrows(FlowSamples const &samples);
+  cv::Mat visualize_optical_flow_blocks(FlowSamples const &samples);
+  cv::Mat visualize_optical_flow_faces(FlowSamples const &samples);
 
 public:
   OpticalFlow(LiveStream &stream, ThreadSafeMat &visualization);
 
   bool isReady();
+  // calculates the flow from the last frame to the next frame of the stream, waits for
+  // it up to FRAME_WAIT
   void operator()();
+  void operator()(FramePtr const &frame);
 
+  TFlow &backend();
   void setFaces(Faces *faces);
   void toggle_visualization();
+  // sparse mode computes lucas-kanade flow at the sample grid only instead of a dense field.
+  // the mode is switched by the stage on its next frame, so it may be called from any thread
+  void setSparse(bool sparse);
+  void toggle_mode();
+  // calculates the flow on frames scaled by this factor. samples and vectors are
+  // still in frame coordinates
+  void setAnalysisScale(double scale);
+  // parameters of the dense flow, e.g. a smaller window for a faster but noisier field
+  void setFlowParams(FarnebackParams const &params);
+  // distance in pixels between the points the visualizations are drawn from
+  void setSampleStride(int stride);
 };
 
 #endif
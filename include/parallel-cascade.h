@@ -0,0 +1,45 @@
+#ifndef PARALLEL_CASCADE_H_INCLUDED
+#define PARALLEL_CASCADE_H_INCLUDED
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "opencv2/core.hpp"
+#include "opencv2/objdetect.hpp"
+
+#include "thread-pool.h"
+
+/*
+ * Runs the scales of a cascade detection on a pool of threads. The scales are split
+ * into contiguous bands of about the same number of windows, each band is detected
+ * without grouping by its own classifier and the candidates of all bands are grouped
+ * together. This gives the same faces as a single detectMultiScale call.
+ */
+class ParallelCascade {
+
+private:
+  // a classifier is not safe to use from several threads at once, one per band
+  std::vector<std::unique_ptr<cv::CascadeClassifier>> mCascades;
+  ThreadPool mPool;
+
+  struct Band {
+    cv::Size min_size;
+    cv::Size max_size;
+  };
+
+  std::vector<Band> split_scales(cv::Size const &image, double scale_factor,
+                                 cv::Size const &min_size, cv::Size const &max_size) const;
+
+public:
+  ParallelCascade(std::string const &face_cascade, int threads);
+
+  bool empty() const;
+  int threads() const;
+
+  void detectMultiScale(cv::Mat const &image, std::vector<cv::Rect> &objects,
+                        double scale_factor, int min_neighbours,
+                        cv::Size const &min_size, cv::Size const &max_size);
+};
+
+#endif
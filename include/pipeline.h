@@ -0,0 +1,116 @@
+#ifndef PIPELINE_H_INCLUDED
+#define PIPELINE_H_INCLUDED
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "frame.h"
+#include "metrics.h"
+#include "util.h"
+#include "work-stealing-pool.h"
+
+/*
+ * Stage graph executor. Stages declare the stages whose results they need and run on a
+ * work stealing pool as soon as all of them finished the same frame. Several frames are
+ * in flight at once, so independent stages and consecutive frames use all cores.
+ *
+ * A stage that did not run for a frame, because it is disabled or was busy, counts as
+ * skipped and its dependents skip that frame as well.
+ */
+class Pipeline {
+
+public:
+  enum Policy {
+    // stateless, runs for every frame and for several frames at once
+    CONCURRENT,
+    // runs for every frame, one at a time and in the order of the frames
+    SERIAL,
+    // one frame at a time, skips the frames arriving while it is busy
+    LATEST,
+  };
+
+  using StageFunction = std::function<void(FramePtr const &)>;
+
+private:
+  struct Job;
+
+  struct Stage {
+    std::string name;
+    Policy policy;
+    StageFunction function;
+    std::vector<int> inputs;
+    std::vector<int> dependents;
+    std::atomic<bool> enabled;
+
+    // SERIAL and LATEST
+    std::mutex mutex;
+    bool running = false;
+    // SERIAL: index of the next job to run and the jobs that are ready before their turn
+    uint64_t next = 0;
+    std::map<uint64_t, std::pair<std::shared_ptr<Job>, bool>> waiting;
+    // LATEST: the newest job that was run, older ones are skipped
+    uint64_t newest = 0;
+
+    RateCounter rate;
+    Counter *skips;
+  };
+
+  // one frame on its way through the graph
+  struct Job {
+    uint64_t index;
+    FramePtr frame;
+    // per stage: inputs that did not finish yet and whether one of them skipped
+    std::unique_ptr<std::atomic<int>[]> pending;
+    std::unique_ptr<std::atomic<bool>[]> input_skipped;
+    std::atomic<int> remaining;
+  };
+
+  std::vector<std::unique_ptr<Stage>> mStages;
+  bool mStarted = false;
+
+  int const mMaxInFlight;
+  uint64_t mNextJob = 0;
+  std::atomic<int> mInFlight;
+  std::mutex mDoneMutex;
+  std::condition_variable mDone;
+
+  Counter &mDropped = Metrics::instance().counter("tdot_pipeline_frames_dropped_total",
+                                                  "Frames not processed because too many were in flight");
+  Gauge &mInFlightGauge = Metrics::instance().gauge("tdot_pipeline_frames_in_flight",
+                                                    "Frames currently processed by the pipeline");
+
+  // last member: its workers are joined before the stages are destroyed
+  std::unique_ptr<WorkStealingPool> mPool;
+
+  void ready(std::shared_ptr<Job> const &job, int stage);
+  void dispatch_serial(int stage);
+  void run(std::shared_ptr<Job> const &job, int stage, bool skip);
+  void finish(std::shared_ptr<Job> const &job, int stage, bool skipped);
+
+public:
+  // threads: 0 for one per cpu. max_in_flight: frames processed at the same time
+  Pipeline(int threads, int max_in_flight);
+  ~Pipeline();
+
+  // returns the id of the stage. inputs are ids of stages added before
+  int addStage(std::string const &name, std::vector<int> const &inputs, Policy policy,
+               StageFunction function);
+
+  void setEnabled(int stage, bool enabled);
+  bool isEnabled(int stage) const;
+  // rate of the frames the stage processed
+  RateCounter const &rate(int stage) const;
+
+  // returns false if the frame was dropped because too many frames are in flight
+  bool submit(FramePtr const &frame);
+  // waits until all submitted frames went through the graph
+  void drain();
+};
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef QUALITY_CONTROLLER_H_INCLUDED
+#define QUALITY_CONTROLLER_H_INCLUDED
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "metrics.h"
+
+/*
+ * Holds the latency of the stages below a frame budget by trading quality for time.
+ * Every stage has knobs, e.g. its analysis scale, with a list of settings from the best
+ * quality to the cheapest. When the mean latency of a stage exceeds the budget its first
+ * knob that is not at the cheapest setting is lowered one step. When all stages stay well
+ * below the budget for a while the last lowered knob is raised again.
+ *
+ * update() evaluates the latencies and decides, it is called regularly by one thread.
+ * The settings are applied by apply(stage), called by the stage itself before it runs,
+ * so a stage never changes its parameters while it is running.
+ */
+class QualityController {
+
+public:
+  using Setter = std::function<void(double value)>;
+
+  struct Decision {
+    double time_s;
+    std::string stage;
+    std::string knob;
+    // mean latency of the stage that caused the decision
+    double latency_ms;
+    double from;
+    double to;
+  };
+
+private:
+  struct Knob {
+    std::string stage;
+    std::string name;
+    std::vector<double> values;
+    Setter setter;
+    // index into values, set by update() and applied by the stage
+    std::atomic<int> level;
+    int applied = 0;
+    Gauge *gauge;
+  };
+
+  struct Stage {
+    std::string name;
+    Histogram *latency;
+    uint64_t last_count = 0;
+    double last_sum = 0;
+  };
+
+  double mBudget;
+  std::vector<std::unique_ptr<Knob>> mKnobs;
+  std::vector<Stage> mStages;
+
+  // lowered knobs, the last one is raised first
+  std::vector<int> mLowered;
+  int mLastRaised = -1;
+  int mHeadroomWindows = 0;
+  int mRaiseWindows;
+  int mSettleWindows = 0;
+
+  int64_t mStart;
+  int64_t mLastUpdate;
+
+  std::vector<Decision> mDecisions;
+  mutable std::mutex mDecisionMutex;
+  std::ofstream mLogFile;
+
+  Counter &mLowers = Metrics::instance().counter("tdot_quality_changes_total",
+                                                 "Settings changed by the quality controller",
+                                                 "direction=\"lower\"");
+  Counter &mRaises = Metrics::instance().counter("tdot_quality_changes_total",
+                                                 "Settings changed by the quality controller",
+                                                 "direction=\"raise\"");
+
+  // seconds between two evaluations of the latencies
+  double const WINDOW = 0.5;
+  // stages with fewer runs in a window are not judged
+  uint64_t const MIN_SAMPLES = 2;
+  // quality is raised again when every stage is below this fraction of the budget
+  double const HEADROOM = 0.6;
+  // windows with headroom before raising, doubled when a raise had to be undone
+  static int const RAISE_WINDOWS = 4;
+  static int const MAX_RAISE_WINDOWS = 64;
+
+  Stage &stage(std::string const &name);
+  void change(Knob &knob, int level, double latency_ms);
+
+public:
+  explicit QualityController(double budget_ms);
+
+  // knobs of a stage are lowered in the order they are added. values go from the best
+  // quality to the cheapest, the first one is the current setting
+  void addKnob(std::string const &stage, std::string const &name, std::vector<double> const &values,
+               Setter setter);
+
+  // additionally writes every decision as a line to this file
+  bool setLogFile(std::string const &file);
+
+  // evaluates the latencies once per window, cheap to call more often
+  void update();
+  // applies the settings of the knobs of this stage that changed since the last call
+  void apply(std::string const &stage);
+
+  double budget() const { return mBudget; }
+  std::vector<Decision> decisions() const;
+};
+
+#endif
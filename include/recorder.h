@@ -0,0 +1,73 @@
+#ifndef RECORDER_H_INCLUDED
+#define RECORDER_H_INCLUDED
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "opencv2/core.hpp"
+#include "opencv2/videoio.hpp"
+
+#include "metrics.h"
+
+/*
+ * Writes images to a video file on its own thread. write() only queues the image, which
+ * has to be read only like the images published through ThreadSafeMat, so the producing
+ * stage never waits for the encoder unless the BLOCK policy asks for it.
+ */
+class Recorder {
+
+public:
+  enum Policy {
+    // a full queue drops the new image
+    DROP,
+    // a full queue makes write() wait for the encoder
+    BLOCK,
+  };
+
+private:
+  std::string mName;
+  cv::VideoWriter mWriter;
+  cv::Size mSize;
+
+  size_t mQueueSize;
+  Policy mPolicy;
+  std::deque<cv::Mat> mQueue;
+  mutable std::mutex mMutex;
+  std::condition_variable mQueued;
+  std::condition_variable mTaken;
+  // set while no encoder runs
+  bool mStop = true;
+  std::thread mThread;
+
+  Counter &mWritten;
+  Counter &mDropped;
+
+  void encode_loop();
+
+public:
+  // name labels the metrics of the recorder, e.g. "live"
+  Recorder(std::string const &name, size_t queue_size = 8, Policy policy = DROP);
+  ~Recorder();
+
+  Recorder(Recorder const &) = delete;
+  Recorder &operator=(Recorder const &) = delete;
+
+  // opens the file for images of this size and starts the encoder. fourcc is e.g. "MJPG"
+  bool start(std::string const &file, double fps, cv::Size const &size, bool color,
+             std::string const &fourcc = "MJPG");
+  // encodes the queued images and closes the file
+  void stop();
+  bool isRecording() const;
+  std::string const &name() const { return mName; }
+
+  // queues image for encoding. returns false if it was dropped
+  bool write(cv::Mat const &image);
+
+  uint64_t written() const;
+  uint64_t dropped() const;
+};
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef SHM_RING_H_INCLUDED
+#define SHM_RING_H_INCLUDED
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ * Ring of frames in POSIX shared memory, so other processes on the machine get the
+ * captured frames without opening the camera. The writer never waits for readers and
+ * readers never copy the pixels, which also means a slot can be overwritten while a
+ * reader still looks at it: readers check valid() after they are done with the pixels.
+ *
+ * This header and shm-ring.cpp need neither OpenCV nor the rest of the demo, consumers
+ * only build these two (make shm-lib) and link -lrt.
+ *
+ * Layout: ShmRingHeader, then `slots` slots of `slot_bytes` each. A slot starts with its
+ * ShmSlot, the pixels follow at `pixel_offset` from the start of the slot.
+ */
+
+int const SHM_RING_MAGIC = 0x54444f54;
+int const SHM_RING_LAYOUT = 1;
+int const SHM_MAX_FACES = 32;
+
+struct ShmFace {
+  // stays the same while the face is tracked
+  uint64_t id;
+  int32_t x;
+  int32_t y;
+  int32_t width;
+  int32_t height;
+};
+
+struct ShmFrameInfo {
+  // increases by one for every captured frame, starting at 1
+  uint64_t seq;
+  // steady clock (CLOCK_MONOTONIC) at publication in ns
+  int64_t timestamp_ns;
+  // time spent reading, decoding and scaling the frame
+  double capture_ms;
+  int32_t width;
+  int32_t height;
+  // opencv type of the pixels, e.g. 16 for CV_8UC3 in bgr order
+  int32_t type;
+  // bytes per row, the rows follow each other without gaps
+  int32_t step;
+  // faces known when the frame was captured, detected on one of the frames before
+  int32_t num_faces;
+  ShmFace faces[SHM_MAX_FACES];
+};
+
+struct ShmSlot {
+  // seq of the frame in the slot, 0 while it is written
+  std::atomic<uint64_t> seq;
+  ShmFrameInfo info;
+};
+
+struct ShmRingHeader {
+  // set last by the writer once the ring is initialized, cleared when it closes the ring
+  std::atomic<uint32_t> magic;
+  uint32_t layout;
+  uint32_t slots;
+  uint32_t pixel_offset;
+  uint64_t slot_bytes;
+  uint64_t pixel_bytes;
+  // seq of the latest complete frame, 0 before the first one
+  std::atomic<uint64_t> latest;
+};
+
+class ShmRingWriter {
+
+private:
+  std::string mName;
+  ShmRingHeader *mHeader = nullptr;
+  size_t mSize = 0;
+
+  ShmSlot *slot(uint64_t seq) const;
+
+public:
+  ~ShmRingWriter();
+
+  // creates the shared memory object name, e.g. "/tdot-frames", replacing an old one.
+  // every slot holds frames of up to pixel_bytes
+  bool create(std::string const &name, int slots, size_t pixel_bytes);
+  // unlinks the ring, readers notice it through closed()
+  void close();
+  bool isOpen() const { return mHeader != nullptr; }
+
+  // copies rows of row_bytes each, step bytes apart, into the slot of info.seq and
+  // publishes it as the latest frame. false if the frame does not fit into a slot
+  bool write(ShmFrameInfo const &info, void const *pixels, size_t row_bytes, size_t step);
+};
+
+// a frame in the ring. pixels points into the shared memory and is only valid as long
+// as ShmRingReader::valid() says so
+struct ShmFrameView {
+  ShmFrameInfo info;
+  void const *pixels = nullptr;
+};
+
+class ShmRingReader {
+
+private:
+  ShmRingHeader const *mHeader = nullptr;
+  size_t mSize = 0;
+
+  ShmSlot const *slot(uint64_t seq) const;
+
+public:
+  ~ShmRingReader();
+
+  // maps the ring created by a writer read only
+  bool open(std::string const &name);
+  void close();
+  bool isOpen() const { return mHeader != nullptr; }
+  // the writer closed the ring, open it again to get the frames of a new writer
+  bool closed() const;
+
+  // seq of the latest frame, 0 before the first one. never blocks
+  uint64_t latestSeq() const;
+  // the latest frame without copying its pixels. false if there is none yet
+  bool latest(ShmFrameView &view) const;
+  // whether the slot of the view still holds its frame, i.e. the pixels read since
+  // latest() were not overwritten in the meantime
+  bool valid(ShmFrameView const &view) const;
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef SPRITE_CACHE_H_INCLUDED
+#define SPRITE_CACHE_H_INCLUDED
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+#include "opencv2/core.hpp"
+
+#include "metrics.h"
+
+struct Sprite {
+  cv::Mat color;
+  cv::Mat alpha;
+};
+
+struct SpriteCacheStats {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t evictions = 0;
+  size_t entries = 0;
+  size_t bytes = 0;
+};
+
+// least recently used cache of scaled sprites with a bounded memory budget
+class SpriteCache {
+
+private:
+  using Entry = std::pair<int, Sprite>;
+  // most recently used entry first
+  std::list<Entry> mEntries;
+  std::unordered_map<int, std::list<Entry>::iterator> mIndex;
+
+  size_t mBudget;
+  size_t mBytes = 0;
+
+  std::atomic<uint64_t> mHits;
+  std::atomic<uint64_t> mMisses;
+  std::atomic<uint64_t> mEvictions;
+
+  mutable std::mutex mMutex;
+
+  // shared by the caches of all sprites
+  Counter &mHitsTotal = Metrics::instance().counter("tdot_sprite_cache_hits_total",
+                                                    "Scaled sprites found in the cache");
+  Counter &mMissesTotal = Metrics::instance().counter("tdot_sprite_cache_misses_total",
+                                                      "Sprites that had to be scaled");
+  Counter &mEvictionsTotal = Metrics::instance().counter("tdot_sprite_cache_evictions_total",
+                                                         "Sprites evicted to stay in the memory budget");
+
+  static size_t bytes(Sprite const &sprite);
+  void evict();
+
+public:
+  SpriteCache(size_t budget_bytes);
+
+  // sprites share their data with the cache and must not be modified
+  bool get(int key, Sprite &sprite);
+  void put(int key, Sprite const &sprite);
+
+  void setBudget(size_t budget_bytes);
+  SpriteCacheStats stats() const;
+};
+
+#endif
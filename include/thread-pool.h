@@ -0,0 +1,38 @@
+#ifndef THREAD_POOL_H_INCLUDED
+#define THREAD_POOL_H_INCLUDED
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// fixed number of worker threads running submitted tasks in order
+class ThreadPool {
+
+private:
+  std::vector<std::thread> mThreads;
+  std::deque<std::function<void()>> mTasks;
+
+  std::mutex mMutex;
+  std::condition_variable mEvent;
+  bool mStop = false;
+
+  void worker();
+
+public:
+  // 0 starts one thread per cpu
+  explicit ThreadPool(int threads = 0);
+  ~ThreadPool();
+
+  ThreadPool(ThreadPool const &) = delete;
+  ThreadPool &operator=(ThreadPool const &) = delete;
+
+  int size() const;
+
+  std::future<void> submit(std::function<void()> task);
+};
+
+#endif
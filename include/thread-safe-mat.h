@@ -1,21 +1,40 @@
 #ifndef THREAD_SAFE_MAT_INCLUDED
 #define THREAD_SAFE_MAT_INCLUDED
 
-#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <memory>
 #include "opencv2/core.hpp"
 
+/*
+ * Mailbox holding the latest image of a producer. Publishing and reading only swap a
+ * reference counted pointer, the pixels are never copied. A published image is shared
+ * with every reader, so neither side may write into it afterwards.
+ */
 class ThreadSafeMat {
 
 private:
-  cv::Mat mMat;
+  struct Published {
+    cv::Mat mat;
+    uint64_t version;
+  };
 
-  std::mutex mMutex;
+  // accessed with std::atomic_load and std::atomic_store only
+  std::shared_ptr<Published const> mPublished;
+  std::atomic<uint64_t> mVersion;
 
 public:
   ThreadSafeMat();
   ThreadSafeMat(cv::Mat mat);
 
-  cv::Mat get();
+  // the latest image, read only
+  cv::Mat get() const;
+  // the latest image and the version it was published as
+  cv::Mat get(uint64_t &version) const;
+  // increases with every update, 0 before the first one
+  uint64_t version() const;
+
+  // publishes mat without copying it, the caller must not write into it anymore
   void update(cv::Mat new_mat);
 
 };
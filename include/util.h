@@ -1,6 +1,9 @@
 #ifndef UTIL_H_INCLUDED
 #define UTIL_H_INCLUDED
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <string>
 #include <sstream>
 #include <vector>
@@ -30,4 +33,77 @@ inline cv::Point print_times(cv::Mat image, cv::Point start, std::vector<Printab
   return start;
 }
 
+// measures the rate of an event, e.g. frames per second of a stage. tick() must only be
+// called from one thread, rate() can be read from any thread
+class RateCounter {
+
+private:
+  std::atomic<int64_t> mLastTick;
+  std::atomic<double> mInterval;
+  std::atomic<uint64_t> mCount;
+
+public:
+  RateCounter() : mLastTick(0), mInterval(0), mCount(0) { }
+
+  void tick()
+  {
+    int64_t now = cv::getTickCount();
+    int64_t last = mLastTick.load(std::memory_order_relaxed);
+
+    if (last != 0) {
+      // exponential moving average of the interval smooths the displayed rate
+      double dt = (now - last) / cv::getTickFrequency();
+      double avg = mInterval.load(std::memory_order_relaxed);
+      mInterval.store((avg == 0) ? dt : (avg * 0.9 + dt * 0.1), std::memory_order_relaxed);
+    }
+
+    mLastTick.store(now, std::memory_order_relaxed);
+    mCount.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // events per second. decays towards 0 when ticks stop arriving
+  double rate() const
+  {
+    int64_t last = mLastTick.load(std::memory_order_relaxed);
+    double interval = mInterval.load(std::memory_order_relaxed);
+    if ((last == 0) || (interval == 0)) {
+      return 0;
+    }
+
+    double since_last = (cv::getTickCount() - last) / cv::getTickFrequency();
+    return 1.0 / std::max(interval, since_last);
+  }
+
+  uint64_t count() const
+  {
+    return mCount.load(std::memory_order_relaxed);
+  }
+};
+
+// maps a rect between the frame and a scaled copy of it
+inline cv::Rect scale_rect(cv::Rect const &rect, double sx, double sy)
+{
+  return cv::Rect(cvRound(rect.x * sx), cvRound(rect.y * sy),
+                  cvRound(rect.width * sx), cvRound(rect.height * sy));
+}
+
+struct PrintableRate {
+  std::string text;
+  RateCounter const *rate;
+};
+
+inline cv::Point print_rates(cv::Mat image, cv::Point start, std::vector<PrintableRate> rates)
+{
+  for (auto r : rates) {
+    std::stringstream ss;
+    ss.precision(3);
+    ss << r.text << r.rate->rate() << "/s";
+
+    cv::putText(image, ss.str(), start, cv::FONT_HERSHEY_PLAIN, 1.2, cv::Scalar(128, 255, 255));
+    start.y += 15;
+  }
+
+  return start;
+}
+
 #endif
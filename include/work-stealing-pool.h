@@ -0,0 +1,55 @@
+#ifndef WORK_STEALING_POOL_H_INCLUDED
+#define WORK_STEALING_POOL_H_INCLUDED
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Thread pool with one task queue per worker. Tasks submitted by a worker go to its
+ * own queue and are run newest first, which keeps the data of a frame in its cache.
+ * Idle workers steal the oldest tasks of the other queues.
+ */
+class WorkStealingPool {
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  std::vector<std::unique_ptr<Queue>> mQueues;
+  std::vector<std::thread> mThreads;
+  // queue for the next task submitted from outside of the pool
+  std::atomic<size_t> mNextQueue;
+
+  // number of queued tasks, workers sleep while there are none
+  std::atomic<int> mQueued;
+  std::mutex mIdleMutex;
+  std::condition_variable mIdle;
+  bool mStop = false;
+
+  bool pop(size_t queue, std::function<void()> &task);
+  bool steal(size_t thief, std::function<void()> &task);
+  void worker(size_t index);
+
+public:
+  // 0 starts one thread per cpu
+  explicit WorkStealingPool(int threads = 0);
+  // runs the remaining tasks before returning
+  ~WorkStealingPool();
+
+  WorkStealingPool(WorkStealingPool const &) = delete;
+  WorkStealingPool &operator=(WorkStealingPool const &) = delete;
+
+  int size() const;
+
+  void submit(std::function<void()> task);
+};
+
+#endif
@@ -1,28 +1,99 @@
 #include "livestream.h"
 
+#include "opencv2/imgcodecs.hpp"
 #include "opencv2/videoio.hpp"
 #include "opencv2/imgproc.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <cctype>
 #include <iostream>
+#include <thread>
+
+#include <sys/stat.h>
+
+namespace {
+
+// joins intersecting rectangles. compositing them one by one would blend their
+// intersection twice
+void merge_overlapping(std::vector<cv::Rect> &rects)
+{
+  bool merged = true;
+  while (merged) {
+    merged = false;
+    for (size_t i = 0; (i < rects.size()) && !merged; i++) {
+      for (size_t j = i + 1; j < rects.size(); j++) {
+        if ((rects[i] & rects[j]).area() > 0) {
+          rects[i] |= rects[j];
+          rects.erase(rects.begin() + j);
+          merged = true;
+          break;
+        }
+      }
+    }
+  }
+}
+
+// blends a row of bgr pixels of overlay onto image. the loops are free of branches and
+// work on consecutive bytes so the compiler vectorizes them (sse2/neon)
+void blend_row(uchar *image, uchar const *overlay, uchar const *alpha, uchar *alpha3, int pixels)
+{
+  for (int x = 0; x < pixels; x++) {
+    alpha3[3 * x] = alpha[x];
+    alpha3[3 * x + 1] = alpha[x];
+    alpha3[3 * x + 2] = alpha[x];
+  }
+
+  int const n = 3 * pixels;
+  for (int i = 0; i < n; i++) {
+    unsigned int a = alpha3[i];
+    unsigned int v = overlay[i] * a + image[i] * (255 - a) + 128;
+    // exact rounded division by 255
+    image[i] = (uchar) ((v + (v >> 8)) >> 8);
+  }
+}
+
+}
 
 LiveStream::LiveStream(int camNum) : LiveStream(camNum, -1, -1)
 {
 }
 
 LiveStream::LiveStream(int camNum, int width, int height)
+                      : mEndOfStream(false), mStopCapture(false), mFramePool(MAX_FRAME_POOL)
 {
   if (!openCamera(camNum, width, height)) {
     return;
   }
 
-  mOverlay = cv::Mat::zeros(mStreamHeight, mStreamWidth, CV_8UC3);
-  resetOverlay();
-  getCurrentFrame();
+  initialize();
+}
+
+LiveStream::LiveStream(std::string const &source, int width, int height,
+                       PlaybackOptions const &playback)
+                      : mPlayback(playback), mEndOfStream(false), mStopCapture(false),
+                        mFramePool(MAX_FRAME_POOL)
+{
+  struct stat st;
+  bool opened;
+
+  if ((stat(source.c_str(), &st) == 0) && S_ISDIR(st.st_mode)) {
+    opened = openImageDirectory(source, width, height);
+  } else {
+    opened = openFile(source, width, height);
+  }
+
+  if (!opened) {
+    return;
+  }
+
+  initialize();
 }
 
 LiveStream::~LiveStream()
 {
+  stop();
+
   if (mCamera.isOpened()) {
     mCamera.release();
   }
@@ -69,26 +140,296 @@ bool LiveStream::openCamera(int num, int width, int height)
   return true;
 }
 
-void LiveStream::getCurrentFrame()
+bool LiveStream::openFile(std::string const &path, int width, int height)
+{
+  mSourceType = SOURCE_VIDEO_FILE;
+  mCamera.open(path);
+
+  if (!mCamera.isOpened()) {
+    std::cerr << "could not open video file " << path << std::endl;
+    return false;
+  }
+
+  double fps = (mPlayback.fps > 0) ? mPlayback.fps : mCamera.get(cv::CAP_PROP_FPS);
+  if (fps <= 0) {
+    // image sequence patterns and some containers do not carry a frame rate
+    fps = 30;
+  }
+  mPlayback.fps = fps;
+
+  mStreamWidth = (width != -1) ? width : mCamera.get(cv::CAP_PROP_FRAME_WIDTH);
+  mStreamHeight = (height != -1) ? height : mCamera.get(cv::CAP_PROP_FRAME_HEIGHT);
+
+  std::cout << "initialized video file '" << path << "' with "
+            << mStreamWidth << "x" << mStreamHeight << " @ " << fps << " fps" << std::endl;
+  return true;
+}
+
+bool LiveStream::openImageDirectory(std::string const &path, int width, int height)
 {
+  static std::vector<std::string> const extensions =
+    { ".png", ".jpg", ".jpeg", ".bmp", ".ppm", ".pgm", ".tif", ".tiff" };
+
+  mSourceType = SOURCE_IMAGE_SEQUENCE;
+
+  std::vector<std::string> files;
+  cv::glob(path, files, false);
+
+  for (std::string const &file : files) {
+    size_t dot = file.find_last_of('.');
+    if (dot == std::string::npos) {
+      continue;
+    }
+
+    std::string ext = file.substr(dot);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    if (std::find(extensions.begin(), extensions.end(), ext) != extensions.end()) {
+      mImageFiles.push_back(file);
+    }
+  }
+  std::sort(mImageFiles.begin(), mImageFiles.end());
+
+  if (mImageFiles.empty()) {
+    std::cerr << "no images found in directory " << path << std::endl;
+    return false;
+  }
+
+  cv::Mat first = cv::imread(mImageFiles.front());
+  if (first.empty()) {
+    std::cerr << "could not read image " << mImageFiles.front() << std::endl;
+    mImageFiles.clear();
+    return false;
+  }
+
+  if (mPlayback.fps <= 0) {
+    mPlayback.fps = 30;
+  }
+
+  mStreamWidth = (width != -1) ? width : first.cols;
+  mStreamHeight = (height != -1) ? height : first.rows;
+
+  std::cout << "initialized image directory '" << path << "' with " << mImageFiles.size()
+            << " images of " << mStreamWidth << "x" << mStreamHeight
+            << " @ " << mPlayback.fps << " fps" << std::endl;
+  return true;
+}
+
+void LiveStream::initialize()
+{
+  if (mSourceType != SOURCE_CAMERA) {
+    mFramePeriod = std::chrono::nanoseconds((long long) (1e9 / mPlayback.fps));
+    mNextFrameTime = std::chrono::steady_clock::now();
+  }
+
+  // the overlay planes are allocated once, resets only clear the areas written to
+  mOverlay = cv::Mat::zeros(mStreamHeight, mStreamWidth, CV_8UC3);
+  mOverlayAlpha = cv::Mat::zeros(mStreamHeight, mStreamWidth, CV_8UC1);
+  resetOverlay();
+  captureFrame();
+}
+
+bool LiveStream::readFromSource(cv::Mat &frame)
+{
+  switch (mSourceType) {
+    case SOURCE_CAMERA:
+      return mCamera.read(frame);
+
+    case SOURCE_VIDEO_FILE:
+      if (mCamera.read(frame)) {
+        return true;
+      }
+      if (!mPlayback.loop) {
+        return false;
+      }
+      // rewind and try once more, an empty file would loop forever otherwise
+      mCamera.set(cv::CAP_PROP_POS_FRAMES, 0);
+      return mCamera.read(frame);
+
+    case SOURCE_IMAGE_SEQUENCE:
+      if (mNextImage >= mImageFiles.size()) {
+        if (!mPlayback.loop) {
+          return false;
+        }
+        mNextImage = 0;
+      }
+      frame = cv::imread(mImageFiles[mNextImage++]);
+      return !frame.empty();
+  }
+
+  return false;
+}
+
+void LiveStream::waitForFrameTime()
+{
+  if ((mSourceType == SOURCE_CAMERA) || !mPlayback.paced) {
+    return;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  if (mNextFrameTime > now) {
+    std::this_thread::sleep_until(mNextFrameTime);
+    mNextFrameTime += mFramePeriod;
+  } else {
+    // consumer fell behind, do not try to catch up with a burst of frames
+    mNextFrameTime = now + mFramePeriod;
+  }
+}
+
+std::shared_ptr<Frame> LiveStream::acquireFrameBuffer()
+{
+  // all buffers are in use by slow readers when one is allocated instead of waiting for them
+  bool allocated;
+  std::shared_ptr<Frame> frame = mFramePool.acquire(allocated);
+  if (allocated) {
+    mFrameAllocations.inc();
+  }
+  return frame;
+}
+
+bool LiveStream::captureFrame()
+{
+  if (mEndOfStream) {
+    return false;
+  }
+
   /*
   cv::Mat yuv;
   mCamera.read(yuv);
-  cv::cvtColor(yuv, mCurrentFrame, cv::COLOR_YUV2BGR);
+  cv::cvtColor(yuv, mRawFrame, cv::COLOR_YUV2BGR);
   */
   /*
   cv::Mat jpg;
   mCamera.read(jpg);
-  mCurrentFrame = cv::imdecode(jpg, 1);
+  mRawFrame = cv::imdecode(jpg, 1);
   */
-  mCamera.read(mCurrentFrame);
+  double capture_start = (double) cv::getTickCount();
+
+  if (!readFromSource(mRawFrame)) {
+    mEndOfStream = true;
+    notifyFrame();
+    return false;
+  }
+
+  std::shared_ptr<Frame> frame = acquireFrameBuffer();
+  frame->derived.clear();
+  if ((mRawFrame.cols != mStreamWidth) || (mRawFrame.rows != mStreamHeight)) {
+    cv::resize(mRawFrame, frame->image, cv::Size(mStreamWidth, mStreamHeight), 0, 0, cv::INTER_AREA);
+  } else {
+    // hand the captured buffer over and capture into the recycled one next time
+    std::swap(mRawFrame, frame->image);
+  }
+  frame->seq = ++mFrameSeq;
+  frame->timestamp = std::chrono::steady_clock::now();
+  frame->capture_ms = ((double) cv::getTickCount() - capture_start) / cv::getTickFrequency() * 1000;
+
+  std::atomic_store(&mLatestFrame, std::shared_ptr<Frame const>(frame));
+  notifyFrame();
+  if (mShmRing.isOpen()) {
+    exportFrame(*frame);
+  }
+  mCaptureRate.tick();
+  mCaptureLatency.observe(frame->capture_ms / 1000);
+  mFramesCaptured.inc();
+  return true;
+}
+
+void LiveStream::captureLoop()
+{
+  while (!mStopCapture) {
+    waitForFrameTime();
+    if (!captureFrame()) {
+      std::cout << "end of input reached" << std::endl;
+      return;
+    }
+  }
+}
+
+bool LiveStream::exportFrames(std::string const &name, int slots)
+{
+  // captured frames are 8 bit bgr
+  size_t const frame_bytes = (size_t) mStreamWidth * mStreamHeight * 3;
+  return mShmRing.create(name, slots, frame_bytes);
+}
+
+void LiveStream::setExportFaces(Faces const *faces)
+{
+  mExportFaces = faces;
+}
+
+void LiveStream::exportFrame(Frame const &frame)
+{
+  ShmFrameInfo info;
+  info.seq = frame.seq;
+  info.timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        frame.timestamp.time_since_epoch()).count();
+  info.capture_ms = frame.capture_ms;
+  info.width = frame.image.cols;
+  info.height = frame.image.rows;
+  info.type = frame.image.type();
+  info.step = frame.image.step;
+  info.num_faces = 0;
+
+  if (mExportFaces != nullptr) {
+    FacesSnapshot faces = mExportFaces->snapshot();
+    for (Face const &face : *faces) {
+      if (info.num_faces == SHM_MAX_FACES) {
+        break;
+      }
+      ShmFace &f = info.faces[info.num_faces++];
+      f.id = face.id;
+      f.x = face.rect.x;
+      f.y = face.rect.y;
+      f.width = face.rect.width;
+      f.height = face.rect.height;
+    }
+  }
+
+  if (mShmRing.write(info, frame.image.data, frame.image.cols * frame.image.elemSize(), frame.image.step)) {
+    mFramesExported.inc();
+  }
+}
+
+void LiveStream::start()
+{
+  if (mCaptureThread.joinable()) {
+    return;
+  }
+
+  mStopCapture = false;
+  mCaptureThread = std::thread(&LiveStream::captureLoop, this);
+}
+
+void LiveStream::stop()
+{
+  mStopCapture = true;
+  if (mCaptureThread.joinable()) {
+    mCaptureThread.join();
+  }
+}
+
+RateCounter const &LiveStream::captureRate() const
+{
+  return mCaptureRate;
 }
 
 bool LiveStream::isOpened() const
 {
+  if (mSourceType == SOURCE_IMAGE_SEQUENCE) {
+    return !mImageFiles.empty();
+  }
   return mCamera.isOpened();
 }
 
+bool LiveStream::isLive() const
+{
+  return mSourceType == SOURCE_CAMERA;
+}
+
+bool LiveStream::finished() const
+{
+  return mEndOfStream;
+}
+
 int LiveStream::width() const
 {
   return mStreamWidth;
@@ -99,19 +440,39 @@ int LiveStream::height() const
   return mStreamHeight;
 }
 
-void LiveStream::getFrame(cv::Mat &frame)
+FramePtr LiveStream::getFrame() const
 {
-  std::unique_lock<std::mutex> l(mFrameMutex);
+  return std::atomic_load(&mLatestFrame);
+}
 
-  mCurrentFrame.copyTo(frame);
+void LiveStream::notifyFrame()
+{
+  // waiters check the frame under the lock, taking it here means none can miss the wakeup
+  {
+    std::unique_lock<std::mutex> l(mFrameMutex);
+  }
+  mFrameEvent.notify_all();
 }
 
-void LiveStream::nextFrame(cv::Mat &frame)
+FramePtr LiveStream::waitForFrame(uint64_t seq, std::chrono::milliseconds timeout) const
 {
   std::unique_lock<std::mutex> l(mFrameMutex);
+  mFrameEvent.wait_for(l, timeout, [this, seq]()
+                       {
+                         FramePtr frame = getFrame();
+                         return (frame && (frame->seq > seq)) || mEndOfStream;
+                       });
+  return getFrame();
+}
+
+FramePtr LiveStream::nextFrame()
+{
+  waitForFrameTime();
 
-  getCurrentFrame();
-  mCurrentFrame.copyTo(frame);
+  if (!captureFrame()) {
+    return nullptr;
+  }
+  return getFrame();
 }
 
 std::recursive_mutex &LiveStream::getOverlayMutex()
@@ -122,14 +483,30 @@ std::recursive_mutex &LiveStream::getOverlayMutex()
 void LiveStream::resetOverlay()
 {
   std::unique_lock<std::recursive_mutex> l(mOverlayMutex);
-  mOverlayAlpha = cv::Mat::zeros(mStreamHeight, mStreamWidth, CV_8UC1);
+  for (cv::Rect const &rect : mOverlayRects) {
+    mOverlayAlpha(rect).setTo(cv::Scalar(0));
+    mOverlay(rect).setTo(cv::Scalar(0, 0, 0));
+  }
+  mOverlayRects.clear();
   mOverlayTTL = DEFAULT_TTL;
 }
 
+std::vector<cv::Rect> LiveStream::overlayRects() const
+{
+  std::unique_lock<std::recursive_mutex> l(mOverlayMutex);
+  return mOverlayRects;
+}
+
 void LiveStream::addImageToOverlay(AlphaImage const &image, int width, int x, int y)
 {
+  std::unique_lock<std::recursive_mutex> l(mOverlayMutex);
+
   cv::Rect roi(x, y, image.width(width), image.height(width));
-  image.write_scaled(mOverlay, mOverlayAlpha, roi);
+  cv::Rect written = image.write_scaled(mOverlay, mOverlayAlpha, roi);
+  if ((written.width > 0) && (written.height > 0)) {
+    mOverlayRects.push_back(written);
+    merge_overlapping(mOverlayRects);
+  }
 }
 
 void LiveStream::applyOverlay(cv::Mat &image)
@@ -137,13 +514,18 @@ void LiveStream::applyOverlay(cv::Mat &image)
   assert(image.cols == mStreamWidth);
   assert(image.rows == mStreamHeight);
 
+  ScopedTimer timer(mCompositeLatency);
   std::unique_lock<std::recursive_mutex> l(mOverlayMutex);
 
-  for (int w = 0; w < mStreamWidth; w++) {
-    for (int h = 0; h < mStreamHeight; h++) {
-      if (mOverlayAlpha.at<uchar>(h, w) > 0) {
-        image.at<cv::Vec3b>(h, w) = mOverlay.at<cv::Vec3b>(h, w);
-      }
+  for (cv::Rect const &rect : mOverlayRects) {
+    mBlendAlphaRow.resize(3 * rect.width);
+
+    for (int y = rect.y; y < rect.y + rect.height; y++) {
+      blend_row(image.ptr<uchar>(y) + 3 * rect.x,
+                mOverlay.ptr<uchar>(y) + 3 * rect.x,
+                mOverlayAlpha.ptr<uchar>(y) + rect.x,
+                mBlendAlphaRow.data(),
+                rect.width);
     }
   }
 
@@ -1,21 +1,31 @@
-#include <condition_variable>
 #include <iostream>
 #include <vector>
 #include <thread>
 #include <chrono>
 #include <atomic>
+#include <csignal>
+#include <limits>
+#include <memory>
 #include <unistd.h>
 #include <sys/syscall.h>
 
 #include "opencv2/objdetect.hpp"
 #include "opencv2/highgui.hpp"
 #include "opencv2/imgproc.hpp"
+
+#ifdef WITH_CUDA
 #include "opencv2/cuda.hpp"
-#include "opencv2/cudaoptflow.hpp"
+#endif
 
 #include "augmented-reality.h"
+#include "edge-detection.h"
 #include "facedetection.h"
+#include "metrics.h"
+#include "mjpeg-server.h"
 #include "optical-flow.h"
+#include "pipeline.h"
+#include "quality-controller.h"
+#include "recorder.h"
 #include "util.h"
 
 using namespace std;
@@ -25,23 +35,102 @@ using timepoint = std::chrono::time_point<std::chrono::high_resolution_clock>;
 
 struct Options {
   int cam_num = 0;
+  std::string input;
+  PlaybackOptions playback;
   int width = 640;
   int height = 480;
   bool face_detect = false;
   bool augmented_reality = false;
   bool optical_flow = false;
+  bool cpu_flow = false;
+  bool sparse_flow = false;
+  int flow_threads = 0;
+  int sprite_cache_kb = 8 * 1024;
+  int detect_interval = FaceDetection<>::DEFAULT_DETECT_INTERVAL;
+  int full_scan_interval = 1;
+  int detect_threads = 1;
+  // analysis resolution of the stages relative to the capture resolution
+  double face_scale = 1;
+  double flow_scale = 1;
+  double edge_scale = 1;
+  int pipeline_threads = 0;
+  int frames_in_flight = 4;
+  // latency budget of every stage in ms, 0 keeps the quality fixed
+  double target_latency_ms = 0;
+  std::string quality_log;
+  // video files of the live, edge and flow views, empty to not record them
+  std::string record_live;
+  std::string record_edges;
+  std::string record_flow;
+  double record_fps = 30;
+  int record_queue = 8;
+  bool record_block = false;
+  // mjpeg preview over http, 0 to not serve it
+  int http_port = 0;
+  std::string http_address = "127.0.0.1";
+  int http_quality = 80;
+  bool headless = false;
+  // shared memory ring the frames are exported to, empty to not export them
+  std::string shm_ring;
+  int shm_slots = 4;
   std::string face_xml = "face.xml";
+  std::string metrics_file;
+  int metrics_interval_ms = 1000;
+  std::string metrics_socket;
 };
 
 std::ostream &operator<<(ostream &out, Options const &o)
 {
-  out << "Camera:            " << o.cam_num << std::endl
+  if (o.input.empty()) {
+    out << "Camera:            " << o.cam_num << std::endl;
+  } else {
+    out << "Input:             " << o.input << std::endl
+        << "Playback:          " << (o.playback.paced ? "paced" : "as fast as possible")
+                                 << (o.playback.loop ? ", looping" : "") << std::endl;
+  }
+  out
       << "Width:             " << o.width << std::endl
       << "Height:            " << o.height << std::endl
       << "Facedetect:        " << std::boolalpha << o.face_detect << std::endl
       << "Augmented Reality: " << std::boolalpha << o.augmented_reality << std::endl
       << "Optical Flow:      " << std::boolalpha << o.optical_flow << std::endl
+      << "Flow Backend:      " << (o.cpu_flow ? "cpu" : "cuda") << std::endl
+      << "Flow Mode:         " << (o.sparse_flow ? "sparse" : "dense") << std::endl
+      << "Detect Interval:   " << o.detect_interval << " frames" << std::endl
+      << "Full Scan:         every " << o.full_scan_interval << " cascade runs" << std::endl
+      << "Detect Threads:    " << o.detect_threads << std::endl
+      << "Analysis Scales:   faces " << o.face_scale << ", flow " << o.flow_scale
+                                 << ", edges " << o.edge_scale << std::endl
+      << "Pipeline:          " << o.pipeline_threads << " threads (0: one per cpu), "
+                                 << o.frames_in_flight << " frames in flight" << std::endl
+      << "Sprite Cache:      " << o.sprite_cache_kb << " KB per hat" << std::endl
       << "Haarcascade XML:   " << o.face_xml << std::endl;
+  if (!o.metrics_file.empty()) {
+    out << "Metrics File:      " << o.metrics_file << " every " << o.metrics_interval_ms << "ms" << std::endl;
+  }
+  if (o.target_latency_ms > 0) {
+    out << "Target Latency:    " << o.target_latency_ms << "ms per stage" << std::endl;
+  }
+  if (!o.quality_log.empty()) {
+    out << "Quality Log:       " << o.quality_log << std::endl;
+  }
+  if (!o.metrics_socket.empty()) {
+    out << "Metrics Socket:    " << o.metrics_socket << std::endl;
+  }
+  if (!o.record_live.empty() || !o.record_edges.empty() || !o.record_flow.empty()) {
+    out << "Recording:         " << o.record_fps << " fps, " << o.record_queue << " queued frames, "
+                                 << (o.record_block ? "blocking" : "dropping") << " when full" << std::endl;
+  }
+  if (o.http_port > 0) {
+    out << "HTTP Preview:      http://" << o.http_address << ":" << o.http_port << "/, jpeg quality "
+                                 << o.http_quality << std::endl;
+  }
+  if (o.headless) {
+    out << "Windows:           none" << std::endl;
+  }
+  if (!o.shm_ring.empty()) {
+    out << "Frame Ring:        " << o.shm_ring << ", " << o.shm_slots << " slots" << std::endl;
+  }
   return out;
 }
 
@@ -52,13 +141,51 @@ void usage(char const * const progname)
             << std::endl
             << "Options:" << std::endl
             << " -c, --camera: Number of the camera to capture. E.g. 0 for /dev/video0" << std::endl
+            << " -i, --input: Video file, image sequence pattern or directory of images to play" << std::endl
+            << "              back instead of capturing from a camera" << std::endl
+            << " --fps: Playback rate of the input. Defaults to the rate of the video file" << std::endl
+            << " --fast: Play the input back as fast as possible instead of at its frame rate" << std::endl
+            << " --loop: Restart the input when its end is reached" << std::endl
             << " -w, --width: Width of the captured image" << std::endl
             << " -h, --height: Height of the captured image" << std::endl
             << " -f, --face-detect: Enable face detection" << std::endl
             << "                    (needed for augmented reality and face visualization of optical flow" << std::endl
+            << " --detect-interval: Run the face cascade every n-th frame and track the faces in between" << std::endl
+            << "                    (default " << FaceDetection<>::DEFAULT_DETECT_INTERVAL << ", 1 disables tracking)" << std::endl
+            << " --full-scan-interval: Scan the whole frame on every n-th cascade run and only windows" << std::endl
+            << "                       around the known faces in between (default 1, always the whole frame)" << std::endl
+            << " --detect-threads: Number of threads the scales of the face cascade are split across" << std::endl
+            << " --face-scale, --flow-scale, --edge-scale: Scale of the frames analyzed by face detection," << std::endl
+            << "                    optical flow and edge detection relative to the capture size (default 1)" << std::endl
+            << " --pipeline-threads: Number of threads running the stages. Defaults to one per cpu" << std::endl
+            << " --frames-in-flight: Number of frames processed by the stages at the same time (default 4)" << std::endl
+            << " --target-latency: Latency budget of every stage in ms. Lowers the quality of slow stages" << std::endl
+            << "                   until they fit and raises it again when there is headroom (default off)" << std::endl
+            << " --quality-log: Append the decisions of the quality controller to this file" << std::endl
             << " -a, --augmented-reality: Enable augmented reality" << std::endl
             << " -o, --optical-flow: Enable optical flow analysis" << std::endl
+            << " --cpu-flow: Calculate the optical flow on the cpu instead of the gpu" << std::endl
+            << "             (always used when built without CUDA or no GPU is found)" << std::endl
+            << " --flow-threads: Number of threads of the cpu optical flow. Defaults to one per cpu" << std::endl
+            << " --sparse-flow: Calculate the optical flow only at the points that are visualized" << std::endl
             << " -x, --face-xml: XML file containing haarcascade for face detection" << std::endl
+            << " --sprite-cache: Memory budget in KB for the scaled hats of every hat image" << std::endl
+            << " --metrics-file: Periodically write the metrics in prometheus text format to this file" << std::endl
+            << " --metrics-interval: Interval in ms between writes of the metrics file. Defaults to 1000" << std::endl
+            << " --metrics-socket: Serve the metrics to every client connecting to this unix socket" << std::endl
+            << " --record: Record the live view with hats and timings to this video file" << std::endl
+            << " --record-edges, --record-flow: Record the edge or optical flow view to this video file" << std::endl
+            << " --record-fps: Frame rate stored in the recordings (default 30)" << std::endl
+            << " --record-queue: Frames waiting for the encoder before new ones are dropped (default 8)" << std::endl
+            << " --record-block: Make the stages wait for the encoder instead of dropping frames" << std::endl
+            << " --http-port: Serve the live, edge and optical flow views as mjpeg on this port," << std::endl
+            << "              at /live, /edges and /flow (default off)" << std::endl
+            << " --http-address: Address the mjpeg server listens on (default 127.0.0.1, this machine only)" << std::endl
+            << " --http-quality: Jpeg quality of the served views from 0 to 100 (default 80)" << std::endl
+            << " --headless: Open no windows, e.g. without a display. Stop with ctrl-c" << std::endl
+            << " --shm-ring: Export the frames and faces to this POSIX shared memory object," << std::endl
+            << "             e.g. /tdot-frames, for other processes (see include/shm-ring.h)" << std::endl
+            << " --shm-slots: Number of frames kept in the shared memory ring (default 4)" << std::endl
             << " --help: Show this help" << std::endl
             << std::endl;
 }
@@ -95,6 +222,187 @@ int check_options(Options &opts, int const argc, char const * const *argv)
       }
       opts.cam_num = atoi(argv[i + 1]);
       i++;
+    } else if (arg == "-i" || arg == "--input") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      opts.input = std::string(argv[i + 1]);
+      i++;
+    } else if (arg == "--fps") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      opts.playback.fps = atof(argv[i + 1]);
+      i++;
+    } else if (arg == "--flow-threads") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      opts.flow_threads = atoi(argv[i + 1]);
+      i++;
+    } else if (arg == "--detect-interval") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      opts.detect_interval = atoi(argv[i + 1]);
+      i++;
+    } else if (arg == "--full-scan-interval") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      opts.full_scan_interval = atoi(argv[i + 1]);
+      i++;
+    } else if (arg == "--detect-threads") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      opts.detect_threads = atoi(argv[i + 1]);
+      i++;
+    } else if (arg == "--face-scale" || arg == "--flow-scale" || arg == "--edge-scale") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      double *scale = (arg == "--face-scale") ? &opts.face_scale
+                    : (arg == "--flow-scale") ? &opts.flow_scale : &opts.edge_scale;
+      *scale = atof(argv[i + 1]);
+      if ((*scale <= 0) || (*scale > 1)) {
+        std::cerr << "scale of " << arg << " has to be in (0, 1]" << std::endl;
+        return -1;
+      }
+      i++;
+    } else if (arg == "--pipeline-threads") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      opts.pipeline_threads = atoi(argv[i + 1]);
+      i++;
+    } else if (arg == "--frames-in-flight") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      opts.frames_in_flight = atoi(argv[i + 1]);
+      i++;
+    } else if (arg == "--target-latency") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      opts.target_latency_ms = atof(argv[i + 1]);
+      i++;
+    } else if (arg == "--quality-log") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      opts.quality_log = std::string(argv[i + 1]);
+      i++;
+    } else if (arg == "--sprite-cache") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      opts.sprite_cache_kb = atoi(argv[i + 1]);
+      i++;
+    } else if (arg == "--metrics-file") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      opts.metrics_file = std::string(argv[i + 1]);
+      i++;
+    } else if (arg == "--metrics-interval") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      opts.metrics_interval_ms = std::max(atoi(argv[i + 1]), 1);
+      i++;
+    } else if (arg == "--metrics-socket") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      opts.metrics_socket = std::string(argv[i + 1]);
+      i++;
+    } else if (arg == "--record" || arg == "--record-edges" || arg == "--record-flow") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      std::string *file = (arg == "--record") ? &opts.record_live
+                        : (arg == "--record-edges") ? &opts.record_edges : &opts.record_flow;
+      *file = std::string(argv[i + 1]);
+      i++;
+    } else if (arg == "--record-fps") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      opts.record_fps = atof(argv[i + 1]);
+      i++;
+    } else if (arg == "--record-queue") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      opts.record_queue = std::max(atoi(argv[i + 1]), 1);
+      i++;
+    } else if (arg == "--record-block") {
+      opts.record_block = true;
+    } else if (arg == "--http-port") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      opts.http_port = atoi(argv[i + 1]);
+      i++;
+    } else if (arg == "--http-address") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      opts.http_address = std::string(argv[i + 1]);
+      i++;
+    } else if (arg == "--http-quality") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      opts.http_quality = atoi(argv[i + 1]);
+      i++;
+    } else if (arg == "--headless") {
+      opts.headless = true;
+    } else if (arg == "--shm-ring") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      opts.shm_ring = std::string(argv[i + 1]);
+      i++;
+    } else if (arg == "--shm-slots") {
+      if ((i + 1) >= argc) {
+        std::cerr << "missing value for " << arg << std::endl;
+        return -1;
+      }
+      opts.shm_slots = std::max(atoi(argv[i + 1]), 2);
+      i++;
+    } else if (arg == "--sparse-flow") {
+      opts.sparse_flow = true;
+    } else if (arg == "--cpu-flow") {
+      opts.cpu_flow = true;
+    } else if (arg == "--fast") {
+      opts.playback.paced = false;
+    } else if (arg == "--loop") {
+      opts.playback.loop = true;
     } else if (arg == "-x" || arg == "--face-xml") {
       if ((i + 1) >= argc) {
         std::cerr << "missing value for " << arg << std::endl;
@@ -119,63 +427,29 @@ int check_options(Options &opts, int const argc, char const * const *argv)
   return i;
 }
 
-class ConditionalWait {
-private:
-  std::atomic<bool> &mExit;
-
-  std::mutex mMutex;
-  std::condition_variable mEvent;
-  bool mFlag;
-
-public:
-  ConditionalWait(std::atomic<bool> &exit, bool init) : mExit(exit), mFlag(init) { }
-  operator bool() { return mFlag; }
-
-  void set() {
-    mFlag = true;
-    notify();
-  }
-
-  void clear() {
-    mFlag = false;
-    notify();
-  }
-
-  void toggle() {
-    mFlag = !mFlag;
-    notify();
-  }
-
-  void wait() {
-    if (mFlag) return;
-
-    std::unique_lock<std::mutex> l(mMutex);
-    mEvent.wait(l, [&](){return mExit || mFlag;});
-  }
-
-  void notify() {
-    mEvent.notify_all();
-  }
-};
-
-cv::Mat detect_edges(LiveStream &stream)
+template <typename TFlow>
+void configure_flow_backend(TFlow &backend, Options const &opts)
 {
-  cv::Mat edges;
+}
 
-  int const filter_size = 7;
+template <>
+void configure_flow_backend(CpuFarnebackFlow &backend, Options const &opts)
+{
+  backend.setThreads(opts.flow_threads);
+}
 
-  stream.getFrame(edges);
-  cv::cvtColor(edges, edges, cv::COLOR_BGR2GRAY);
-  cv::GaussianBlur(edges, edges, Size(filter_size, filter_size), 2.5, 2.5);
-  cv::Canny(edges, edges, 1, 25, 3);
+// set by ctrl-c, the only way to stop without windows
+volatile std::sig_atomic_t interrupted = 0;
 
-  return edges;
+void on_interrupt(int)
+{
+  interrupted = 1;
 }
 
+template <typename TFlow>
 void capture_loop(LiveStream &stream, Options opts)
 {
-  std::atomic<bool> exit(false);
-  cv::Mat image;
+  bool exit = false;
 
   vector<AlphaImage> hats;
   Faces faces;
@@ -185,6 +459,12 @@ void capture_loop(LiveStream &stream, Options opts)
     std::cerr << "loading FaceDetection failed" << std::endl;
     return;
   }
+  facedetection.setDetectInterval(opts.detect_interval);
+  facedetection.setFullScanInterval(opts.full_scan_interval);
+  facedetection.setAnalysisScale(opts.face_scale);
+  if (!facedetection.setDetectThreads(opts.detect_threads)) {
+    return;
+  }
   std::cout << "FaceDetection loaded" << std::endl;
 
   AugmentedReality ar(stream, &faces);
@@ -196,10 +476,14 @@ void capture_loop(LiveStream &stream, Options opts)
     std::cerr << "loading AugmentedReality failed" << std::endl;
     return;
   }
+  ar.setSpriteCacheBudget((size_t) opts.sprite_cache_kb * 1024);
   std::cout << "AugmentedReality loaded" << std::endl;
 
   ThreadSafeMat of_visualize(cv::Mat::zeros(stream.height(), stream.width(), CV_8UC3));
-  OpticalFlow of(stream, of_visualize);
+  OpticalFlow<TFlow> of(stream, of_visualize);
+  configure_flow_backend(of.backend(), opts);
+  of.setSparse(opts.sparse_flow);
+  of.setAnalysisScale(opts.flow_scale);
   of.setFaces(&faces);
   if (!of.isReady()) {
     std::cerr << "loading OpticalFlow failed" << std::endl;
@@ -207,43 +491,178 @@ void capture_loop(LiveStream &stream, Options opts)
   }
   std::cout << "OpticalFlow loaded" << std::endl;
 
-  ConditionalWait face_wait(exit, opts.face_detect);
-  ConditionalWait ar_wait(exit, opts.augmented_reality);
-  ConditionalWait of_wait(exit, opts.optical_flow);
-  std::vector<std::thread> workers;
+  double edge_scale = opts.edge_scale;
+
+  // knobs are lowered in the order they are added, the cheapest loss of quality first
+  std::unique_ptr<QualityController> quality;
+  FarnebackParams flow_params;
+  if (opts.target_latency_ms > 0) {
+    quality.reset(new QualityController(opts.target_latency_ms));
+    if (!opts.quality_log.empty() && !quality->setLogFile(opts.quality_log)) {
+      return;
+    }
+
+    int const interval = opts.detect_interval;
+    quality->addKnob("faces", "detect_interval", { (double) interval, interval * 2.0, interval * 4.0 },
+                     [&facedetection](double v) { facedetection.setDetectInterval((int) v); });
+    quality->addKnob("faces", "scale_factor", { 1.2, 1.3, 1.5 },
+                     [&facedetection](double v) { facedetection.setScaleFactor(v); });
+    quality->addKnob("faces", "scale", { opts.face_scale, opts.face_scale * 0.75, opts.face_scale * 0.5 },
+                     [&facedetection](double v) { facedetection.setAnalysisScale(v); });
+
+    quality->addKnob("flow", "sample_stride", { 10, 15, 20 },
+                     [&of](double v) { of.setSampleStride((int) v); });
+    quality->addKnob("flow", "win_size", { (double) flow_params.winSize, 9, 5 },
+                     [&of, &flow_params](double v)
+                     {
+                       flow_params.winSize = (int) v;
+                       of.setFlowParams(flow_params);
+                     });
+    quality->addKnob("flow", "poly_n", { (double) flow_params.polyN, 5 },
+                     [&of, &flow_params](double v)
+                     {
+                       // sigma recommended by opencv for the neighborhood size
+                       flow_params.polyN = (int) v;
+                       flow_params.polySigma = (v > 5) ? 1.5 : 1.1;
+                       of.setFlowParams(flow_params);
+                     });
+    quality->addKnob("flow", "scale", { opts.flow_scale, opts.flow_scale * 0.75, opts.flow_scale * 0.5 },
+                     [&of](double v) { of.setAnalysisScale(v); });
+
+    quality->addKnob("edges", "scale", { opts.edge_scale, opts.edge_scale * 0.75, opts.edge_scale * 0.5 },
+                     [&edge_scale](double v) { edge_scale = v; });
+  }
 
   std::cout << "PID main thread: " << syscall(SYS_gettid) << std::endl;
 
-  double face_time, ar_time, of_time;
-
-  workers.emplace_back([&facedetection, &ar, &exit, &ar_wait, &face_wait, &face_time, &ar_time]()
-                       {
-                        std::cout << "PID face detection / augmented reality thread: " << syscall(SYS_gettid) << std::endl;
-                        while(!exit) {
-                          face_wait.wait();
-
-                          double t = (double) cv::getTickCount();
-                          facedetection.detect();
-                          face_time = ((double) cv::getTickCount() - t) / getTickFrequency();
-
-                          if (ar_wait) {
-                            double t = (double) cv::getTickCount();
-                            ar();
-                            ar_time = ((double) cv::getTickCount() - t) / getTickFrequency();
-                          }
-                        }
-                       });
-
-  workers.emplace_back([&of, &exit, &of_wait, &of_time]()
-                       {
-                        std::cout << "PID optical flow thread: " << syscall(SYS_gettid) << std::endl;
-                        while(!exit) {
-                          of_wait.wait();
-                          double t = (double) cv::getTickCount();
-                          of();
-                          of_time = ((double) cv::getTickCount() - t) / getTickFrequency();
-                        }
-                       });
+  // the stages report their latencies into the metrics registry themselves
+  Histogram &face_latency = stage_latency("faces");
+  Histogram &ar_latency = stage_latency("ar");
+  Histogram &of_latency = stage_latency("flow");
+  Histogram &composite_latency = stage_latency("composite");
+  Histogram &display_latency = stage_latency("display");
+  RateCounter display_rate;
+
+  // results of the stages, shown by this thread as highgui is not thread safe
+  ThreadSafeMat live_image, edges_image;
+
+  // encoded on their own threads, the stages only queue their images
+  Recorder::Policy const record_policy = opts.record_block ? Recorder::BLOCK : Recorder::DROP;
+  Recorder live_recorder("live", opts.record_queue, record_policy);
+  Recorder edges_recorder("edges", opts.record_queue, record_policy);
+  Recorder flow_recorder("flow", opts.record_queue, record_policy);
+  cv::Size const frame_size(stream.width(), stream.height());
+  if ((!opts.record_live.empty() && !live_recorder.start(opts.record_live, opts.record_fps, frame_size, true)) ||
+      (!opts.record_edges.empty() && !edges_recorder.start(opts.record_edges, opts.record_fps, frame_size, false)) ||
+      (!opts.record_flow.empty() && !flow_recorder.start(opts.record_flow, opts.record_fps, frame_size, true))) {
+    return;
+  }
+  uint64_t recorded_flow = 0;
+
+  // encodes the views on its own thread, only while somebody watches them
+  MjpegServer http;
+  http.addStream("/live", live_image);
+  http.addStream("/edges", edges_image);
+  http.addStream("/flow", of_visualize);
+  http.setQuality(opts.http_quality);
+  bool const http_running = opts.http_port > 0;
+  if (http_running && !http.start(opts.http_port, opts.http_address)) {
+    return;
+  }
+
+  Pipeline pipeline(opts.pipeline_threads, opts.frames_in_flight);
+
+  int const gray_stage = pipeline.addStage("gray", {}, Pipeline::CONCURRENT,
+                                           [](FramePtr const &frame) { frame->gray(); });
+
+  int const edge_stage = pipeline.addStage("edges", { gray_stage }, Pipeline::LATEST,
+                                           [&](FramePtr const &frame)
+                                           {
+                                             if (quality) {
+                                               quality->apply("edges");
+                                             }
+                                             cv::Mat edges = detect_edges(*frame, edge_scale);
+                                             edges_image.update(edges);
+                                             edges_recorder.write(edges);
+                                           });
+
+  int const face_stage = pipeline.addStage("faces", { gray_stage }, Pipeline::LATEST,
+                                           [&facedetection, &quality](FramePtr const &frame)
+                                           {
+                                             if (quality) {
+                                               quality->apply("faces");
+                                             }
+                                             facedetection.detect(frame);
+                                           });
+
+  int const ar_stage = pipeline.addStage("ar", { face_stage }, Pipeline::LATEST,
+                                         [&ar](FramePtr const &) { ar(); });
+
+  int const of_stage = pipeline.addStage("flow", { gray_stage }, Pipeline::LATEST,
+                                         [&](FramePtr const &frame)
+                                         {
+                                           if (quality) {
+                                             quality->apply("flow");
+                                           }
+                                           of(frame);
+
+                                           // the flow is not updated for a frame it has seen already
+                                           uint64_t version;
+                                           cv::Mat visualization = of_visualize.get(version);
+                                           if (flow_recorder.isRecording() && (version != recorded_flow)) {
+                                             recorded_flow = version;
+                                             flow_recorder.write(visualization);
+                                           }
+                                         });
+
+  // the overlay is drawn asynchronously by ar, compositing does not wait for it
+  int const composite_stage = pipeline.addStage("composite", {}, Pipeline::LATEST,
+                                      [&](FramePtr const &frame)
+                                      {
+                                        // published frames are shared with the other stages, draw onto a copy
+                                        cv::Mat image;
+                                        frame->image.copyTo(image);
+                                        stream.applyOverlay(image);
+
+                                        // disabled stages keep their last latency in the registry, show them as 0
+                                        double face_time = pipeline.isEnabled(face_stage) ? face_latency.last() : 0;
+                                        double ar_time = pipeline.isEnabled(ar_stage) ? ar_latency.last() : 0;
+                                        double of_time = pipeline.isEnabled(of_stage) ? of_latency.last() : 0;
+                                        double composite = composite_latency.last();
+                                        double total = std::chrono::duration_cast<std::chrono::microseconds>(
+                                                         std::chrono::steady_clock::now() - frame->timestamp).count() / 1e6
+                                                       + frame->capture_ms / 1000;
+
+                                        std::vector<PrintableTime> times =
+                                        {
+                                          { "facedetect: ", &face_time },
+                                          { "ar:         ", &ar_time },
+                                          { "opt flow:   ", &of_time },
+                                          { "composite:  ", &composite },
+                                          { "total:      ", &total },
+                                        };
+
+                                        cv::Point pos = print_times(image, cv::Point(50, 50), times);
+
+                                        std::vector<PrintableRate> rates =
+                                        {
+                                          { "capture:    ", &stream.captureRate() },
+                                          { "display:    ", &display_rate },
+                                          { "facedetect: ", &pipeline.rate(face_stage) },
+                                          { "ar:         ", &pipeline.rate(ar_stage) },
+                                          { "opt flow:   ", &pipeline.rate(of_stage) },
+                                          { "edges:      ", &pipeline.rate(edge_stage) },
+                                        };
+
+                                        print_rates(image, pos, rates);
+
+                                        live_image.update(image);
+                                        live_recorder.write(image);
+                                      });
+
+  pipeline.setEnabled(face_stage, opts.face_detect);
+  pipeline.setEnabled(ar_stage, opts.augmented_reality);
+  pipeline.setEnabled(of_stage, opts.optical_flow);
 
   const std::string live_feed_window = "Live Feed";
   const std::string opt_flow_window = "Optical Flow";
@@ -258,89 +677,118 @@ void capture_loop(LiveStream &stream, Options opts)
   cv::resizeWindow(live_feed_window, 1920, 1080);
   */
 
-  double time = 0;
+  uint64_t submitted_seq = 0;
+  // versions of the images in the windows. the live and edge images are empty before
+  // their first version, the flow window starts black
+  uint64_t const NOT_SHOWN = std::numeric_limits<uint64_t>::max();
+  uint64_t shown_live = 0;
+  uint64_t shown_edges = 0;
+  uint64_t shown_flow = NOT_SHOWN;
+
+  if (opts.headless) {
+    std::signal(SIGINT, on_interrupt);
+    std::signal(SIGTERM, on_interrupt);
+  }
+
+  stream.setExportFaces(&faces);
+
+  // frames are captured on their own thread, this thread feeds them into the stage graph
+  // and shows the results
+  stream.start();
 
   while (!exit) {
 
-    double t = (double) cv::getTickCount();
-    // take new image
-    stream.nextFrame(image);
+    // sleeps until the next frame is captured, but wakes up regularly to refresh the windows
+    FramePtr frame = stream.waitForFrame(submitted_seq, std::chrono::milliseconds(5));
+    bool new_frame = frame && (frame->seq != submitted_seq);
 
-    if (opt_flow_result) {
-      cv::imshow(opt_flow_window, of_visualize.get());
+    if ((!new_frame && stream.finished()) || interrupted) {
+      exit = true;
+      break;
     }
 
-    if (edge_detection) {
-      cv::Mat edges = detect_edges(stream);
-      cv::imshow(edges_window, edges);
+    if (new_frame) {
+      submitted_seq = frame->seq;
+      pipeline.submit(frame);
     }
 
-    if (live_feed) {
-      stream.applyOverlay(image);
-      double total = ((double) getTickCount() - t) / getTickFrequency();
-
-      std::vector<PrintableTime> times =
-      {
-        { "facedetect: ", &face_time },
-        { "ar:         ", &ar_time },
-        { "opt flow:   ", &of_time },
-        { "total:      ", &total },
-      };
+    if (quality) {
+      quality->update();
+    }
 
-      cv::Point pos = print_times(image, cv::Point(50, 50), times);
+    // the views are still composited for the recorders and the mjpeg server
+    if (opts.headless) {
+      continue;
+    }
 
-      double frame_rate = ((double) getTickCount() - time) / getTickFrequency();
-      std::stringstream ss;
-      ss << "FPS: " << 1/frame_rate;
-      cv::putText(image, ss.str(), pos, FONT_HERSHEY_PLAIN, 1.2, Scalar(128, 255, 255));
+    // only images that were not shown yet are passed to highgui
+    uint64_t version;
+    cv::Mat flow = of_visualize.get(version);
+    if (opt_flow_result && (version != shown_flow)) {
+      shown_flow = version;
+      cv::imshow(opt_flow_window, flow);
+    }
 
-      cv::imshow(live_feed_window, image);
+    cv::Mat edges = edges_image.get(version);
+    if (edge_detection && (version != shown_edges)) {
+      shown_edges = version;
+      cv::imshow(edges_window, edges);
     }
 
-    time = (double) getTickCount();
+    cv::Mat live = live_image.get(version);
+    if (live_feed && (version != shown_live)) {
+      double t = (double) cv::getTickCount();
+      shown_live = version;
+      cv::imshow(live_feed_window, live);
+      display_latency.observe(((double) getTickCount() - t) / getTickFrequency());
+      display_rate.tick();
+    }
 
-    // check for button press for 30ms. necessary for opencv to refresh windows
-    char key = cv::waitKey(5);
+    // check for button press. necessary for opencv to refresh windows
+    char key = cv::waitKey(1);
     switch (key) {
       case 'q':
         exit = true;
-        ar_wait.notify();
-        of_wait.notify();
-        face_wait.notify();
         break;
       case 'l':
         live_feed = !live_feed;
+        // a recording or the mjpeg server keeps compositing without the window
+        pipeline.setEnabled(composite_stage, live_feed || live_recorder.isRecording() || http_running);
         cv::destroyWindow(live_feed_window);
+        shown_live = 0;
         break;
       case 'k':
         opt_flow_result = !opt_flow_result;
         cv::destroyWindow(opt_flow_window);
+        shown_flow = NOT_SHOWN;
         break;
       case 'v':
         of.toggle_visualization();
         break;
+      case 'm':
+        of.toggle_mode();
+        break;
       case 'o':
-        of_wait.toggle();
-        std::cout << "OpticalFlow: " << (of_wait ? "enabled" : "disabled") << std::endl;
+        pipeline.setEnabled(of_stage, !pipeline.isEnabled(of_stage));
+        std::cout << "OpticalFlow: " << (pipeline.isEnabled(of_stage) ? "enabled" : "disabled") << std::endl;
         of_visualize.update(cv::Mat::zeros(stream.height(), stream.width(), CV_8UC3));
-        of_time = 0;
         break;
       case 'f':
-        face_wait.toggle();
-        std::cout << "FaceDetection: " << (face_wait ? "enabled" : "disabled") << std::endl;
-        face_time = 0;
+        pipeline.setEnabled(face_stage, !pipeline.isEnabled(face_stage));
+        std::cout << "FaceDetection: " << (pipeline.isEnabled(face_stage) ? "enabled" : "disabled") << std::endl;
         break;
       case 'a':
-        ar_wait.toggle();
-        std::cout << "AugmentedReality: " << (ar_wait ? "enabled" : "disabled") << std::endl;
+        pipeline.setEnabled(ar_stage, !pipeline.isEnabled(ar_stage));
+        std::cout << "AugmentedReality: " << (pipeline.isEnabled(ar_stage) ? "enabled" : "disabled") << std::endl;
         stream.resetOverlay();
-        ar_time = 0;
         break;
       case 'e':
         edge_detection = !edge_detection;
+        pipeline.setEnabled(edge_stage, edge_detection || edges_recorder.isRecording() || http_running);
         std::cout << "EdgeDetection: " << (edge_detection ? "enabled" : "disabled") << std::endl;
         if (!edge_detection) {
           cv::destroyWindow(edges_window);
+          shown_edges = 0;
         }
         break;
       default:
@@ -348,9 +796,30 @@ void capture_loop(LiveStream &stream, Options opts)
     }
   }
 
-  for (auto &t : workers) {
-    t.join();
+  pipeline.drain();
+  stream.stop();
+  http.stop();
+
+  for (Recorder *recorder : { &live_recorder, &edges_recorder, &flow_recorder }) {
+    if (recorder->isRecording()) {
+      recorder->stop();
+      std::cout << "Recording " << recorder->name() << ": " << recorder->written() << " frames written, "
+                << recorder->dropped() << " dropped" << std::endl;
+    }
+  }
+
+  FaceDetection<cv::CascadeClassifier>::Stats detection = facedetection.stats();
+  std::cout << "Face detection: " << detection.full_scans << " full scans, " << detection.roi_scans
+            << " scans around known faces, " << detection.tracked << " tracked frames" << std::endl;
+
+  if (quality) {
+    std::cout << "Quality controller: " << quality->decisions().size() << " decisions" << std::endl;
   }
+
+  SpriteCacheStats sprites = ar.spriteCacheStats();
+  std::cout << "Sprite cache: " << sprites.hits << " hits, " << sprites.misses << " misses, "
+            << sprites.evictions << " evictions, " << sprites.entries << " sprites in "
+            << sprites.bytes / 1024 << " KB" << std::endl;
 }
 
 int main(int argc, char **argv)
@@ -363,23 +832,62 @@ int main(int argc, char **argv)
   }
   argc -= nopts;
 
+#ifdef WITH_CUDA
+  if (!opts.cpu_flow && (cv::cuda::getCudaEnabledDeviceCount() <= 0)) {
+    std::cout << "no CUDA device found, falling back to cpu" << std::endl;
+    opts.cpu_flow = true;
+  }
+#else
+  opts.cpu_flow = true;
+#endif
+
   std::cout << "Options: " << std::endl << opts;
 
-  int gpu = 0;
-  cv::cuda::setDevice(gpu);
-  cv::cuda::resetDevice();
-  cv::cuda::DeviceInfo info;
-  std::cout << "using GPU" << gpu << ": "
-            << info.freeMemory() / 1024 / 1024 << " / "
-            << info.totalMemory() / 1024 / 1024 << " MB in use" << std::endl;
-
-  LiveStream live(opts.cam_num, opts.width, opts.height);
-  if (!live.isOpened()) {
-    cerr << "Error opening camera " << opts.cam_num << endl;
+#ifdef WITH_CUDA
+  if (!opts.cpu_flow) {
+    int gpu = 0;
+    cv::cuda::setDevice(gpu);
+    cv::cuda::resetDevice();
+    cv::cuda::DeviceInfo info;
+    std::cout << "using GPU" << gpu << ": "
+              << info.freeMemory() / 1024 / 1024 << " / "
+              << info.totalMemory() / 1024 / 1024 << " MB in use" << std::endl;
+  }
+#endif
+
+  MetricsExporter metrics_file, metrics_socket;
+  if (!opts.metrics_file.empty()) {
+    metrics_file.startFile(opts.metrics_file, opts.metrics_interval_ms);
+  }
+  if (!opts.metrics_socket.empty() && !metrics_socket.startSocket(opts.metrics_socket)) {
     return -1;
   }
 
-  capture_loop(live, opts);
+  std::unique_ptr<LiveStream> live;
+  if (opts.input.empty()) {
+    live.reset(new LiveStream(opts.cam_num, opts.width, opts.height));
+  } else {
+    live.reset(new LiveStream(opts.input, opts.width, opts.height, opts.playback));
+  }
+  if (!live->isOpened()) {
+    if (opts.input.empty()) {
+      cerr << "Error opening camera " << opts.cam_num << endl;
+    } else {
+      cerr << "Error opening input " << opts.input << endl;
+    }
+    return -1;
+  }
+  if (!opts.shm_ring.empty() && !live->exportFrames(opts.shm_ring, opts.shm_slots)) {
+    return -1;
+  }
+
+#ifdef WITH_CUDA
+  if (!opts.cpu_flow) {
+    capture_loop<CudaFarnebackFlow>(*live, opts);
+    return 0;
+  }
+#endif
+  capture_loop<CpuFarnebackFlow>(*live, opts);
 
   return 0;
 }
@@ -0,0 +1,282 @@
+#include "metrics.h"
+
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+void atomic_add(std::atomic<double> &value, double add)
+{
+  double old = value.load(std::memory_order_relaxed);
+  while (!value.compare_exchange_weak(old, old + add, std::memory_order_relaxed)) {
+  }
+}
+
+std::string series(std::string const &name, std::string const &labels, std::string const &extra = "")
+{
+  std::string all = labels;
+  if (!extra.empty()) {
+    all += (all.empty() ? "" : ",") + extra;
+  }
+  return all.empty() ? name : (name + "{" + all + "}");
+}
+
+}
+
+void Counter::write(std::ostream &out, std::string const &name, std::string const &labels) const
+{
+  out << series(name, labels) << " " << value() << "\n";
+}
+
+void Gauge::write(std::ostream &out, std::string const &name, std::string const &labels) const
+{
+  out << series(name, labels) << " " << value() << "\n";
+}
+
+double const Histogram::BOUNDS[Histogram::BUCKETS] =
+{
+  0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0
+};
+
+Histogram::Histogram() : mCount(0), mSum(0), mLast(0)
+{
+  for (auto &bucket : mBuckets) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+}
+
+void Histogram::observe(double seconds)
+{
+  int bucket = 0;
+  while ((bucket < BUCKETS) && (seconds > BOUNDS[bucket])) {
+    bucket++;
+  }
+
+  mBuckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  atomic_add(mSum, seconds);
+  mLast.store(seconds, std::memory_order_relaxed);
+  mCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Histogram::write(std::ostream &out, std::string const &name, std::string const &labels) const
+{
+  uint64_t cumulative = 0;
+  for (int i = 0; i < BUCKETS; i++) {
+    cumulative += mBuckets[i].load(std::memory_order_relaxed);
+    std::ostringstream le;
+    le << "le=\"" << BOUNDS[i] << "\"";
+    out << series(name + "_bucket", labels, le.str()) << " " << cumulative << "\n";
+  }
+  cumulative += mBuckets[BUCKETS].load(std::memory_order_relaxed);
+  out << series(name + "_bucket", labels, "le=\"+Inf\"") << " " << cumulative << "\n";
+  out << series(name + "_sum", labels) << " " << mSum.load(std::memory_order_relaxed) << "\n";
+  // buckets and count are updated independently, report a consistent count
+  out << series(name + "_count", labels) << " " << cumulative << "\n";
+}
+
+Metrics &Metrics::instance()
+{
+  static Metrics metrics;
+  return metrics;
+}
+
+template <typename TMetric>
+TMetric &Metrics::get(std::string const &name, std::string const &type,
+                      std::string const &help, std::string const &labels)
+{
+  std::unique_lock<std::mutex> l(mMutex);
+
+  Family &family = mFamilies[name];
+  if (family.type.empty()) {
+    family.type = type;
+    family.help = help;
+  }
+  // one name must always be used with the same metric type
+  assert(family.type == type);
+
+  std::unique_ptr<Metric> &metric = family.series[labels];
+  if (!metric) {
+    metric.reset(new TMetric());
+  }
+  return static_cast<TMetric &>(*metric);
+}
+
+Counter &Metrics::counter(std::string const &name, std::string const &help, std::string const &labels)
+{
+  return get<Counter>(name, "counter", help, labels);
+}
+
+Gauge &Metrics::gauge(std::string const &name, std::string const &help, std::string const &labels)
+{
+  return get<Gauge>(name, "gauge", help, labels);
+}
+
+Histogram &Metrics::histogram(std::string const &name, std::string const &help, std::string const &labels)
+{
+  return get<Histogram>(name, "histogram", help, labels);
+}
+
+std::string Metrics::snapshot() const
+{
+  std::unique_lock<std::mutex> l(mMutex);
+  std::ostringstream out;
+
+  for (auto const &family : mFamilies) {
+    out << "# HELP " << family.first << " " << family.second.help << "\n"
+        << "# TYPE " << family.first << " " << family.second.type << "\n";
+    for (auto const &metric : family.second.series) {
+      metric.second->write(out, family.first, metric.first);
+    }
+  }
+
+  return out.str();
+}
+
+Histogram &stage_latency(std::string const &stage)
+{
+  return Metrics::instance().histogram("tdot_stage_latency_seconds",
+                                       "Processing time of a pipeline stage per frame",
+                                       "stage=\"" + stage + "\"");
+}
+
+MetricsExporter::MetricsExporter() : mIntervalMs(1000), mStop(false)
+{
+}
+
+MetricsExporter::~MetricsExporter()
+{
+  stop();
+}
+
+bool MetricsExporter::startFile(std::string const &file, int interval_ms)
+{
+  stop();
+
+  mFile = file;
+  mIntervalMs = interval_ms;
+  mStop = false;
+  mThread = std::thread(&MetricsExporter::export_loop, this);
+
+  std::cout << "exporting metrics to " << file << " every " << interval_ms << "ms" << std::endl;
+  return true;
+}
+
+bool MetricsExporter::startSocket(std::string const &socket_path)
+{
+  stop();
+
+  sockaddr_un addr;
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "metrics socket path too long: " << socket_path << std::endl;
+    return false;
+  }
+
+  int server = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server < 0) {
+    std::cerr << "could not create metrics socket: " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+  // a socket file left behind by an earlier run would make bind fail
+  unlink(socket_path.c_str());
+  if ((bind(server, (sockaddr *) &addr, sizeof(addr)) < 0) || (listen(server, 4) < 0)) {
+    std::cerr << "could not listen on " << socket_path << ": " << strerror(errno) << std::endl;
+    close(server);
+    return false;
+  }
+
+  mSocket = socket_path;
+  mStop = false;
+  mThread = std::thread(&MetricsExporter::serve_loop, this, server);
+
+  std::cout << "serving metrics on " << socket_path << std::endl;
+  return true;
+}
+
+void MetricsExporter::stop()
+{
+  mStop = true;
+  if (mThread.joinable()) {
+    mThread.join();
+  }
+
+  if (!mSocket.empty()) {
+    unlink(mSocket.c_str());
+    mSocket.clear();
+  }
+}
+
+void MetricsExporter::write_file()
+{
+  // write and rename, so readers never see a partially written snapshot
+  std::string tmp = mFile + ".tmp";
+  {
+    std::ofstream out(tmp);
+    out << Metrics::instance().snapshot();
+  }
+  if (rename(tmp.c_str(), mFile.c_str()) != 0) {
+    std::cerr << "could not write metrics to " << mFile << ": " << strerror(errno) << std::endl;
+  }
+}
+
+void MetricsExporter::export_loop()
+{
+  int const sleep_ms = 50;
+  int elapsed_ms = mIntervalMs;
+
+  while (!mStop) {
+    if (elapsed_ms >= mIntervalMs) {
+      write_file();
+      elapsed_ms = 0;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(sleep_ms));
+    elapsed_ms += sleep_ms;
+  }
+
+  // the final values of the run
+  write_file();
+}
+
+void MetricsExporter::serve_loop(int server)
+{
+  while (!mStop) {
+    pollfd pfd = { server, POLLIN, 0 };
+    // wake up regularly to check whether to stop
+    if (poll(&pfd, 1, 200) <= 0) {
+      continue;
+    }
+
+    int client = accept(server, nullptr, nullptr);
+    if (client < 0) {
+      continue;
+    }
+
+    std::string snapshot = Metrics::instance().snapshot();
+    size_t sent = 0;
+    while (sent < snapshot.size()) {
+      ssize_t n = send(client, snapshot.data() + sent, snapshot.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) {
+        break;
+      }
+      sent += n;
+    }
+    close(client);
+  }
+
+  close(server);
+}
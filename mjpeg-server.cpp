@@ -0,0 +1,359 @@
+#include "mjpeg-server.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "opencv2/imgcodecs.hpp"
+
+namespace {
+
+bool set_nonblocking(int fd)
+{
+  int flags = fcntl(fd, F_GETFL, 0);
+  return (flags >= 0) && (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0);
+}
+
+}
+
+MjpegServer::MjpegServer()
+  : mQuality(80), mStop(false),
+    mClients(Metrics::instance().gauge("tdot_http_clients", "Clients connected to the mjpeg server")),
+    mFramesSent(Metrics::instance().counter("tdot_http_frames_sent_total", "Frames sent to mjpeg clients")),
+    mFramesSkipped(Metrics::instance().counter("tdot_http_frames_skipped_total",
+                                               "Frames not sent to a client that was still busy with the last one")),
+    mClientsDropped(Metrics::instance().counter("tdot_http_clients_dropped_total",
+                                                "Clients disconnected because they were too slow")),
+    mClientsRejected(Metrics::instance().counter("tdot_http_clients_rejected_total",
+                                                 "Connections refused because too many clients were connected")),
+    mEncodeLatency(Metrics::instance().histogram("tdot_http_encode_seconds", "Time to encode a frame as jpeg"))
+{
+}
+
+MjpegServer::~MjpegServer()
+{
+  stop();
+}
+
+void MjpegServer::addStream(std::string const &path, ThreadSafeMat const &source)
+{
+  Stream stream = { path, &source, 0, nullptr };
+  mStreams.push_back(stream);
+}
+
+void MjpegServer::setQuality(int quality)
+{
+  mQuality = std::max(0, std::min(quality, 100));
+}
+
+bool MjpegServer::start(int port, std::string const &address)
+{
+  stop();
+
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+    std::cerr << "invalid http address: " << address << std::endl;
+    return false;
+  }
+
+  int server = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (server < 0) {
+    std::cerr << "could not create http socket: " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  // restarting must not wait for the connections of the last run to time out
+  int reuse = 1;
+  setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if ((bind(server, (sockaddr *) &addr, sizeof(addr)) < 0) || (listen(server, 8) < 0) ||
+      !set_nonblocking(server)) {
+    std::cerr << "could not listen on " << address << ":" << port << ": " << strerror(errno) << std::endl;
+    close(server);
+    return false;
+  }
+
+  mStop = false;
+  mThread = std::thread(&MjpegServer::serve_loop, this, server);
+
+  std::cout << "serving mjpeg on http://" << address << ":" << port << "/" << std::endl;
+  return true;
+}
+
+void MjpegServer::stop()
+{
+  mStop = true;
+  if (mThread.joinable()) {
+    mThread.join();
+  }
+}
+
+void MjpegServer::serve_loop(int server)
+{
+  std::vector<Client> clients;
+  std::vector<pollfd> fds;
+
+  while (!mStop) {
+    fds.clear();
+    pollfd listening = { server, POLLIN, 0 };
+    fds.push_back(listening);
+    for (Client const &client : clients) {
+      // streaming clients are read too, to notice when they hang up
+      pollfd pfd = { client.fd, (short) (POLLIN | (client.sending ? POLLOUT : 0)), 0 };
+      fds.push_back(pfd);
+    }
+
+    // wakes up regularly to check the streams for new images and whether to stop
+    if (poll(fds.data(), fds.size(), POLL_INTERVAL_MS) < 0) {
+      continue;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int fd;
+      while ((fd = accept(server, nullptr, nullptr)) >= 0) {
+        if (!set_nonblocking(fd)) {
+          close(fd);
+          continue;
+        }
+        if (clients.size() >= MAX_CLIENTS) {
+          // best effort, the socket buffer of a new connection takes the whole response
+          static char const busy[] = "HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\n"
+                                     "Connection: close\r\n\r\n";
+          send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL);
+          close(fd);
+          mClientsRejected.inc();
+          continue;
+        }
+        Client client = { fd, "", -1, 0, nullptr, 0, std::chrono::steady_clock::now(), false };
+        clients.push_back(client);
+      }
+    }
+
+    std::vector<bool> closing(clients.size(), false);
+    for (size_t i = 0; i < clients.size(); i++) {
+      // accepted in this iteration, not polled yet
+      if (i + 1 >= fds.size()) {
+        break;
+      }
+      short const revents = fds[i + 1].revents;
+      if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        closing[i] = true;
+      } else if ((revents & POLLIN) && !read_request(clients[i])) {
+        closing[i] = true;
+      }
+    }
+
+    // encode every stream somebody watches once per new image, whatever the number of clients
+    std::vector<bool> watched(mStreams.size(), false);
+    for (Client const &client : clients) {
+      if (client.stream >= 0) {
+        watched[client.stream] = true;
+      }
+    }
+    std::vector<bool> encoded(mStreams.size(), false);
+    for (size_t s = 0; s < mStreams.size(); s++) {
+      encoded[s] = watched[s] && encode(mStreams[s]);
+    }
+
+    std::chrono::steady_clock::time_point const now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < clients.size(); i++) {
+      Client &client = clients[i];
+      if (closing[i]) {
+        continue;
+      }
+
+      if ((client.stream >= 0) && client.sending && (client.version != 0) && encoded[client.stream]) {
+        // still sending an older frame, the new one is never sent to this client
+        mFramesSkipped.inc();
+      }
+
+      if ((client.stream >= 0) && !client.sending) {
+        Stream const &stream = mStreams[client.stream];
+        if (stream.part && (client.version != stream.version)) {
+          client.version = stream.version;
+          client.sending = stream.part;
+          client.sent = 0;
+          client.sending_since = now;
+        }
+      }
+
+      if (client.sending && !send_pending(client)) {
+        closing[i] = true;
+        continue;
+      }
+
+      // without a request nothing is sent, the deadline runs from the accept
+      bool const waiting = client.sending || (client.stream < 0);
+      double const sending_s = std::chrono::duration<double>(now - client.sending_since).count();
+      if (waiting && (sending_s > CLIENT_TIMEOUT_S)) {
+        mClientsDropped.inc();
+        closing[i] = true;
+      }
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < clients.size(); i++) {
+      if (closing[i]) {
+        close(clients[i].fd);
+      } else {
+        clients[kept++] = clients[i];
+      }
+    }
+    clients.resize(kept);
+    mClients.set(clients.size());
+  }
+
+  for (Client const &client : clients) {
+    close(client.fd);
+  }
+  mClients.set(0);
+  close(server);
+}
+
+bool MjpegServer::read_request(Client &client)
+{
+  char buffer[1024];
+  ssize_t n = recv(client.fd, buffer, sizeof(buffer), 0);
+  if (n == 0) {
+    return false;
+  }
+  if (n < 0) {
+    return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+  }
+
+  // whatever a client sends after its request is ignored
+  if ((client.stream >= 0) || client.close_when_sent) {
+    return true;
+  }
+
+  client.request.append(buffer, n);
+  size_t const end = client.request.find("\r\n\r\n");
+  if (end == std::string::npos) {
+    return client.request.size() < MAX_REQUEST;
+  }
+
+  std::istringstream line(client.request.substr(0, client.request.find("\r\n")));
+  std::string method, path;
+  line >> method >> path;
+  path = path.substr(0, path.find('?'));
+  client.request.clear();
+
+  if (method != "GET") {
+    respond(client, "405 Method Not Allowed", "Allow: GET\r\n", "", true);
+    return true;
+  }
+
+  for (size_t s = 0; s < mStreams.size(); s++) {
+    if (mStreams[s].path == path) {
+      client.stream = s;
+      respond(client, "200 OK",
+              "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n"
+              "Cache-Control: no-cache\r\n",
+              "", false);
+      return true;
+    }
+  }
+
+  if (path == "/") {
+    std::ostringstream body;
+    body << "<html><body>\n";
+    for (Stream const &stream : mStreams) {
+      body << "<img src=\"" << stream.path << "\">\n";
+    }
+    body << "</body></html>\n";
+    respond(client, "200 OK", "Content-Type: text/html\r\n", body.str(), true);
+    return true;
+  }
+
+  respond(client, "404 Not Found", "", "", true);
+  return true;
+}
+
+void MjpegServer::respond(Client &client, std::string const &status, std::string const &headers,
+                          std::string const &body, bool close_when_sent)
+{
+  std::ostringstream response;
+  response << "HTTP/1.0 " << status << "\r\n"
+           << headers;
+  if (close_when_sent) {
+    response << "Content-Length: " << body.size() << "\r\n";
+  }
+  response << "Connection: close\r\n"
+           << "\r\n"
+           << body;
+
+  std::string const text = response.str();
+  client.sending = std::make_shared<std::vector<uchar>>(text.begin(), text.end());
+  client.sent = 0;
+  client.sending_since = std::chrono::steady_clock::now();
+  client.close_when_sent = close_when_sent;
+}
+
+bool MjpegServer::send_pending(Client &client)
+{
+  std::vector<uchar> const &buffer = *client.sending;
+  while (client.sent < buffer.size()) {
+    ssize_t n = send(client.fd, buffer.data() + client.sent, buffer.size() - client.sent,
+                     MSG_NOSIGNAL);
+    if (n < 0) {
+      // the socket buffer is full, the rest is sent when poll reports it writable
+      return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+    }
+    client.sent += n;
+  }
+
+  client.sending.reset();
+  if (client.close_when_sent) {
+    return false;
+  }
+  // a stream starts with its headers, before the first frame
+  if (client.version != 0) {
+    mFramesSent.inc();
+  }
+  return true;
+}
+
+bool MjpegServer::encode(Stream &stream)
+{
+  uint64_t version;
+  cv::Mat image = stream.source->get(version);
+  if ((version == stream.version) || image.empty()) {
+    return false;
+  }
+  stream.version = version;
+
+  std::vector<uchar> jpeg;
+  {
+    ScopedTimer timer(mEncodeLatency);
+    if (!cv::imencode(".jpg", image, jpeg, { cv::IMWRITE_JPEG_QUALITY, mQuality })) {
+      return false;
+    }
+  }
+
+  std::ostringstream header;
+  header << "--frame\r\n"
+         << "Content-Type: image/jpeg\r\n"
+         << "Content-Length: " << jpeg.size() << "\r\n"
+         << "\r\n";
+  std::string const head = header.str();
+
+  std::shared_ptr<std::vector<uchar>> part = std::make_shared<std::vector<uchar>>();
+  part->reserve(head.size() + jpeg.size() + 2);
+  part->insert(part->end(), head.begin(), head.end());
+  part->insert(part->end(), jpeg.begin(), jpeg.end());
+  part->push_back('\r');
+  part->push_back('\n');
+  stream.part = part;
+  return true;
+}
@@ -5,10 +5,13 @@
 #include <iostream>
 #include <sstream>
 
+#include "opencv2/video.hpp"
+
 #include "util.h"
 
-std::map<OpticalFlow::VisualizationType, std::string> OpticalFlow::mVisualizationNames = 
-std::map<OpticalFlow::VisualizationType, std::string>(
+template <typename TFlow>
+std::map<typename OpticalFlow<TFlow>::VisualizationType, std::string> OpticalFlow<TFlow>::mVisualizationNames =
+std::map<typename OpticalFlow<TFlow>::VisualizationType, std::string>(
 {
   { VisualizationType::OPTICAL_FLOW_VISUALIZATION_FACES,  "Faces" },
   { VisualizationType::OPTICAL_FLOW_VISUALIZATION_ARROWS, "Arrows" },
@@ -16,29 +19,23 @@ std::map<OpticalFlow::VisualizationType, std::string>(
 }
 );
 
-OpticalFlow::OpticalFlow(LiveStream &stream, ThreadSafeMat &visualization)
-                        : mStream(stream), mVisualizationImage(&visualization)
+template <typename TFlow>
+OpticalFlow<TFlow>::OpticalFlow(LiveStream &stream, ThreadSafeMat &visualization)
+                               : mStream(stream), mVisualizationImage(&visualization),
+                                 mSparseRequested(false)
 {
-  mNowGpuImg = &mGpuImg1;
-  mLastGpuImg = &mGpuImg2;
-  load_new_frame();
-
-  mFarneback.numLevels = 1;         // number of pyramid layers including initial
-  mFarneback.pyrScale = 0.5;        // scale for pyramids. 0.5: next layer is twice smaller
-  mFarneback.fastPyramids = false; 
-  mFarneback.winSize = 13;          // averaging window size
-  mFarneback.numIters = 1;         // iterations per pyramid level
-  mFarneback.polyN = 7;             // size of pixel neighborhood. usally 5 or 7
-  mFarneback.polySigma = 1.5;       // standard deviation for gaussian usually 1.1 or 1.5
-  mFarneback.flags = 0;
+  mFlow.setParams(FarnebackParams());
+  load_new_frame(mStream.getFrame());
 }
 
-bool OpticalFlow::isReady()
+template <typename TFlow>
+bool OpticalFlow<TFlow>::isReady()
 {
   return mStream.isOpened();
 }
 
-int OpticalFlow::get_direction_of_pixel(bool lower_half, cv::Point const &p1, cv::Point const & p2)
+template <typename TFlow>
+int OpticalFlow<TFlow>::get_direction_of_pixel(bool lower_half, cv::Point const &p1, cv::Point const & p2)
 {
   double const diff_threshold = 1;
 
@@ -65,74 +62,176 @@ int OpticalFlow::get_direction_of_pixel(bool lower_half, cv::Point const &p1, cv
   }
 }
 
-void OpticalFlow::load_new_frame()
+template <typename TFlow>
+void OpticalFlow<TFlow>::load_new_frame(FramePtr const &frame)
 {
-  cv::Mat image;
-
-  // swap pointers to avoid reallocating memory on gpu
-  std::swap(mNowGpuImg, mLastGpuImg);
-
-  mStream.getFrame(image);
-  if (image.empty()) {
+  if (!frame || frame->image.empty()) {
     std::cerr << "OpticalFlow cannot load new frame, aborting" << std::endl;
     return;
   }
-  cv::cvtColor(image, image, cv::COLOR_BGR2GRAY);
-  mNowGpuImg->upload(image);
+
+  std::swap(mNowGray, mLastGray);
+  std::swap(mNowPyramid, mLastPyramid);
+  mNowPyramid.clear();
+  // shared with the other stages and referenced by the backend, never written
+  mNowGray = frame->scaled_gray(mScale);
+  mNowSeq = frame->seq;
 }
 
-void OpticalFlow::use_farneback(cv::Mat &flowx, cv::Mat &flowy,
-                                double &calc_time_ms, double &dl_time_ms)
+template <typename TFlow>
+void OpticalFlow<TFlow>::calc_dense_flow(FlowSamples &samples, double &ul_time_ms,
+                                         double &calc_time_ms, double &dl_time_ms)
 {
-  cv::cuda::GpuMat d_flowx, d_flowy;
+  cv::Mat flowx, flowy;
+
+  double ul_start = (double) cv::getTickCount();
+  if (mFlowStale) {
+    // without a last frame of the same size, compare the frame to itself
+    bool const have_last = !mLastGray.empty() && (mLastGray.size() == mNowGray.size());
+    mFlow.load(have_last ? mLastGray : mNowGray);
+  }
+  mFlow.load(mNowGray);
+  mFlowStale = false;
+  ul_time_ms += ((double) cv::getTickCount() - ul_start) / cv::getTickFrequency() * 1000;
+
+  mFlow.calc(flowx, flowy, calc_time_ms, dl_time_ms);
+
+  // the visualizations only look at the sample grid, which is in frame coordinates
+  double const sx = (double) flowx.cols / mStream.width();
+  double const sy = (double) flowx.rows / mStream.height();
+
+  samples.clear();
+  for (int y = 0; y < mStream.height(); y += mSampleStride) {
+    int const fy = std::min(cvFloor(y * sy), flowx.rows - 1);
+    for (int x = 0; x < mStream.width(); x += mSampleStride) {
+      int const fx = std::min(cvFloor(x * sx), flowx.cols - 1);
+      cv::Point2f const flow(flowx.at<float>(fy, fx) / sx, flowy.at<float>(fy, fx) / sy);
+      FlowSample sample = { cv::Point(x, y), flow };
+      samples.push_back(sample);
+    }
+  }
+}
 
+template <typename TFlow>
+void OpticalFlow<TFlow>::calc_sparse_flow(FlowSamples &samples, double &calc_time_ms)
+{
   double calc_start = (double) cv::getTickCount();
-  mFarneback(*mLastGpuImg, *mNowGpuImg, d_flowx, d_flowy, mCudaStream);
-  calc_time_ms = ((double) cv::getTickCount() - calc_start) / cv::getTickFrequency() * 1000;
 
-  double dl_start = (double) cv::getTickCount();
-  d_flowx.download(flowx);
-  d_flowy.download(flowy);
-  dl_time_ms = ((double) cv::getTickCount() - dl_start) / cv::getTickFrequency() * 1000;
+  samples.clear();
+  mFlowStale = true;
+
+  if (mLastGray.empty() || (mLastGray.size() != mNowGray.size())) {
+    calc_time_ms = 0;
+    return;
+  }
+
+  std::vector<cv::Rect> areas;
+  cv::Rect const frame_rect(0, 0, mStream.width(), mStream.height());
+  if ((mVisualization == OPTICAL_FLOW_VISUALIZATION_FACES) && (mFaces != nullptr)) {
+    // only the flow inside of faces is visualized
+    for (Face const &face : *mFaces->snapshot()) {
+      areas.push_back(face.rect & frame_rect);
+    }
+  } else {
+    areas.push_back(frame_rect);
+  }
+
+  std::vector<cv::Point2f> points;
+  for (cv::Rect const &area : areas) {
+    // first grid position inside of the area
+    int x0 = (area.x + mSampleStride - 1) / mSampleStride * mSampleStride;
+    int y0 = (area.y + mSampleStride - 1) / mSampleStride * mSampleStride;
+
+    for (int y = y0; y < area.y + area.height; y += mSampleStride) {
+      for (int x = x0; x < area.x + area.width; x += mSampleStride) {
+        points.push_back(cv::Point2f(x, y));
+      }
+    }
+  }
+
+  if (points.empty()) {
+    calc_time_ms = ((double) cv::getTickCount() - calc_start) / cv::getTickFrequency() * 1000;
+    return;
+  }
+
+  // every pyramid is built once and reused as last pyramid for the next frame
+  if (mLastPyramid.empty()) {
+    cv::buildOpticalFlowPyramid(mLastGray, mLastPyramid, LK_WIN_SIZE, LK_MAX_LEVEL);
+  }
+  cv::buildOpticalFlowPyramid(mNowGray, mNowPyramid, LK_WIN_SIZE, LK_MAX_LEVEL);
+
+  // the grid is in frame coordinates, the gray images may be scaled
+  double const sx = (double) mNowGray.cols / mStream.width();
+  double const sy = (double) mNowGray.rows / mStream.height();
+  std::vector<cv::Point2f> analysis_points(points.size());
+  for (size_t i = 0; i < points.size(); i++) {
+    analysis_points[i] = cv::Point2f(points[i].x * sx, points[i].y * sy);
+  }
+
+  std::vector<cv::Point2f> next_points;
+  std::vector<uchar> status;
+  std::vector<float> error;
+  cv::calcOpticalFlowPyrLK(mLastPyramid, mNowPyramid, analysis_points, next_points, status, error,
+                           LK_WIN_SIZE, LK_MAX_LEVEL);
+
+  samples.reserve(points.size());
+  for (size_t i = 0; i < points.size(); i++) {
+    cv::Point2f flow(0, 0);
+    if (status[i]) {
+      cv::Point2f const d = next_points[i] - analysis_points[i];
+      flow = cv::Point2f(d.x / sx, d.y / sy);
+    }
+    FlowSample sample = { cv::Point(points[i].x, points[i].y), flow };
+    samples.push_back(sample);
+  }
+
+  calc_time_ms = ((double) cv::getTickCount() - calc_start) / cv::getTickFrequency() * 1000;
 }
 
+template <typename TFlow>
 template <typename TFun>
-void OpticalFlow::visualize_optical_flow(cv::Mat const &flowx, cv::Mat const &flowy,
-                                         TFun pixel_callback)
+void OpticalFlow<TFlow>::visualize_optical_flow(FlowSamples const &samples, TFun pixel_callback)
 {
-  int const width = flowx.cols;
-  int const height = flowx.rows;
+  int const height = mStream.height();
   double const l_threshold = 2;
 
-  for (int y = 0; y < height; y += 10) {
-    for (int x = 0; x < width; x += 10) {
-      double dx = flowx.at<float>(y, x);
-      double dy = flowy.at<float>(y, x);
+  for (FlowSample const &sample : samples) {
+    double dx = sample.flow.x;
+    double dy = sample.flow.y;
 
-      double l = std::sqrt(dx*dx + dy*dy);
+    double l = std::sqrt(dx*dx + dy*dy);
 
-      if ((l > l_threshold)) {
-        cv::Point p(x, y);
-        cv::Point p2(x + dx, y + dy);
-        int direction = get_direction_of_pixel((y > height/2), p, p2);
+    if ((l > l_threshold)) {
+      cv::Point p = sample.pos;
+      cv::Point p2(p.x + dx, p.y + dy);
+      int direction = get_direction_of_pixel((p.y > height/2), p, p2);
 
-        pixel_callback(p, p2, direction);
-      }
+      pixel_callback(p, p2, direction);
     }
   }
 }
 
-cv::Mat OpticalFlow::visualize_optical_flow_blocks(cv::Mat const &flowx, cv::Mat const &flowy)
+template <typename TFlow>
+void OpticalFlow<TFlow>::count_directions(FlowSamples const &samples)
 {
-  cv::Mat result = cv::Mat::zeros(flowx.rows, flowy.cols, CV_8UC3);;
-  cv::Mat directions = cv::Mat::zeros(flowx.rows, flowy.cols, CV_8UC1);;
+  mDirections.reset(cv::Size(mStream.width(), mStream.height()), mSampleStride);
 
-  visualize_optical_flow(flowx, flowy,
-                         [&directions](cv::Point const &p1, cv::Point const &p2, unsigned char direction)
+  visualize_optical_flow(samples,
+                         [this](cv::Point const &p1, cv::Point const &p2, unsigned char direction)
                          {
-                          directions.at<uchar>(p1.y, p1.x) = direction;
+                          mDirections.set(p1, direction);
                          });
 
+  mDirections.sum();
+}
+
+template <typename TFlow>
+cv::Mat OpticalFlow<TFlow>::visualize_optical_flow_blocks(FlowSamples const &samples)
+{
+  cv::Mat result = cv::Mat::zeros(mStream.height(), mStream.width(), CV_8UC3);
+
+  count_directions(samples);
+
   int const n_xblocks = 50;
   int const n_yblocks = 50;
   int const x_pixels_per_block = mStream.width() / n_xblocks;
@@ -147,64 +246,26 @@ cv::Mat OpticalFlow::visualize_optical_flow_blocks(cv::Mat const &flowx, cv::Mat
 
       cv::Rect roi(x * x_pixels_per_block, y * y_pixels_per_block, width, height);
 
-      cv::Mat block = directions(roi);
-      int sum_approaching = std::count_if(block.begin<uchar>(),
-                                          block.end<uchar>(),
-                                          [](unsigned char v)
-                                          {
-                                            return v == DIRECTION_APPROACHING;
-                                          });
-      int sum_distancing = std::count_if(block.begin<uchar>(),
-                                         block.end<uchar>(),
-                                         [](unsigned char v)
-                                         {
-                                           return v == DIRECTION_DISTANCING;
-                                         });
-      int sum_undefined = std::count_if(block.begin<uchar>(),
-                                        block.end<uchar>(),
-                                        [](unsigned char v)
-                                        {
-                                          return (v != DIRECTION_APPROACHING) && (v != DIRECTION_DISTANCING);
-                                        });
-      /*
-      std::cout << "block " << roi << "[" << sum_approaching
-                                   << "|" << sum_distancing
-                                   << "|" << sum_undefined
-                                   << "]" << std::endl;
-                                   */
+      DirectionGrid::Counts const counts = mDirections.count(roi);
 
       int block_direction = DIRECTION_UNDEFINED;
       int const threshold = 1;
-      if (sum_approaching > sum_distancing) {
-        /*
-        if (sum_undefined > sum_approaching) {
-          block_direction = DIRECTION_UNDEFINED;
-        } else {
-        */
-        if (sum_approaching > threshold) {
+      if (counts.approaching > counts.distancing) {
+        if (counts.approaching > threshold) {
           block_direction = DIRECTION_APPROACHING;
         }
-        //}
       } else {
-        /*
-        if (sum_undefined > sum_distancing) {
-          block_direction = DIRECTION_UNDEFINED;
-        } else {
-        */
-        if (sum_distancing > threshold) {
+        if (counts.distancing > threshold) {
           block_direction = DIRECTION_DISTANCING;
         }
-        //}
       }
 
       cv::Scalar color;
       switch (block_direction) {
         case DIRECTION_APPROACHING:
-          //std::cout << "block " << x << "/" << y << " APPROACHING" << std::endl;
           color = cv::Scalar(0, 255, 0);
           break;
         case DIRECTION_DISTANCING:
-          //std::cout << "block " << x << "/" << y << " DISTANCING" << std::endl;
           color = cv::Scalar(0, 0, 255);
           break;
         default:
@@ -220,66 +281,58 @@ cv::Mat OpticalFlow::visualize_optical_flow_blocks(cv::Mat const &flowx, cv::Mat
   return result;
 }
 
-cv::Mat OpticalFlow::visualize_optical_flow_faces(cv::Mat const &flowx, cv::Mat const &flowy)
+template <typename TFlow>
+cv::Mat OpticalFlow<TFlow>::visualize_optical_flow_faces(FlowSamples const &samples)
 {
-  cv::Mat result = cv::Mat::zeros(flowx.rows, flowy.cols, CV_8UC3);;
-  cv::Mat directions = cv::Mat::zeros(flowx.rows, flowy.cols, CV_8UC1);;
+  cv::Mat result = cv::Mat::zeros(mStream.height(), mStream.width(), CV_8UC3);
 
   if (mFaces == nullptr) {
     std::cerr << "faces not set" << std::endl;
     return result; 
   }
 
-  visualize_optical_flow(flowx, flowy,
-                         [&directions](cv::Point const &p1, cv::Point const &p2, unsigned char direction)
-                         {
-                          directions.at<uchar>(p1.y, p1.x) = direction;
-                         });
-
-  {
-    std::unique_lock<std::mutex>(mFaces->getMutex());
-
-    for (cv::Rect face : mFaces->getFaces()) {
-      cv::Mat roi = directions(face);
+  count_directions(samples);
 
-      int sum_approaching = std::count_if(roi.begin<uchar>(), roi.end<uchar>(),
-                                          [](unsigned char v) { return v == DIRECTION_APPROACHING; });
-      int sum_distancing = std::count_if(roi.begin<uchar>(), roi.end<uchar>(),
-                                         [](unsigned char v) { return v == DIRECTION_DISTANCING; });
+  // the snapshot does not change while it is drawn
+  FacesSnapshot faces = mFaces->snapshot();
 
-      int block_direction = DIRECTION_UNDEFINED;
-      int const threshold = 40;
-      if ((sum_approaching > sum_distancing) && (sum_approaching > threshold)) {
-          block_direction = DIRECTION_APPROACHING;
-      } else if (sum_distancing > threshold) {
-          block_direction = DIRECTION_DISTANCING;
-      }
+  for (Face const &f : *faces) {
+    cv::Rect const &face = f.rect;
+    DirectionGrid::Counts const counts = mDirections.count(face);
 
-      cv::Scalar color;
-      switch (block_direction) {
-        case DIRECTION_APPROACHING:
-          color = cv::Scalar(0, 255, 0);
-          break;
-        case DIRECTION_DISTANCING:
-          color = cv::Scalar(0, 0, 255);
-          break;
-        default:
-          color = cv::Scalar(255, 255, 255);
-          break;
-      }
+    int block_direction = DIRECTION_UNDEFINED;
+    int const threshold = 40;
+    if ((counts.approaching > counts.distancing) && (counts.approaching > threshold)) {
+        block_direction = DIRECTION_APPROACHING;
+    } else if (counts.distancing > threshold) {
+        block_direction = DIRECTION_DISTANCING;
+    }
 
-      cv::rectangle(result, face, color, cv::FILLED);
+    cv::Scalar color;
+    switch (block_direction) {
+      case DIRECTION_APPROACHING:
+        color = cv::Scalar(0, 255, 0);
+        break;
+      case DIRECTION_DISTANCING:
+        color = cv::Scalar(0, 0, 255);
+        break;
+      default:
+        color = cv::Scalar(255, 255, 255);
+        break;
     }
+
+    cv::rectangle(result, face, color, cv::FILLED);
   }
 
   return result;
 }
 
-cv::Mat OpticalFlow::visualize_optical_flow_arrows(cv::Mat const &flowx, cv::Mat const &flowy)
+template <typename TFlow>
+cv::Mat OpticalFlow<TFlow>::visualize_optical_flow_arrows(FlowSamples const &samples)
 {
-  cv::Mat result = cv::Mat::zeros(flowx.rows, flowy.cols, CV_8UC3);;
+  cv::Mat result = cv::Mat::zeros(mStream.height(), mStream.width(), CV_8UC3);
 
-  visualize_optical_flow(flowx, flowy,
+  visualize_optical_flow(samples,
                          [&result](cv::Point const &p1, cv::Point const &p2, unsigned char direction)
                          {
                           cv::Scalar color;
@@ -299,29 +352,49 @@ cv::Mat OpticalFlow::visualize_optical_flow_arrows(cv::Mat const &flowx, cv::Mat
   return result;
 }
 
-void OpticalFlow::operator()()
+template <typename TFlow>
+void OpticalFlow<TFlow>::operator()()
+{
+  (*this)(mStream.waitForFrame(mNowSeq, FRAME_WAIT));
+}
+
+template <typename TFlow>
+void OpticalFlow<TFlow>::operator()(FramePtr const &frame)
 {
   assert(isReady());
 
-  cv::Mat flowx, flowy, result;
+  // the flow between two copies of the same frame is zero, keep showing the last one
+  if (!frame || (frame->seq == mNowSeq)) {
+    return;
+  }
+
+  FlowSamples samples;
+  cv::Mat result;
 
   double ul_start = (double) cv::getTickCount();
-  load_new_frame();
+  load_new_frame(frame);
   double ul_time_ms = ((double) cv::getTickCount() - ul_start) / cv::getTickFrequency() * 1000;
 
-  double calc_time, dl_time;
-  use_farneback(flowx, flowy, calc_time, dl_time);
+  // sampled once, a switch of the mode in between applies to the next frame
+  mSparse = mSparseRequested;
+
+  double calc_time = 0, dl_time = 0;
+  if (mSparse) {
+    calc_sparse_flow(samples, calc_time);
+  } else {
+    calc_dense_flow(samples, ul_time_ms, calc_time, dl_time);
+  }
 
   double visualize_start = (double) cv::getTickCount();
   switch (mVisualization) {
     case OPTICAL_FLOW_VISUALIZATION_ARROWS:
-      result = visualize_optical_flow_arrows(flowx, flowy);
+      result = visualize_optical_flow_arrows(samples);
       break;
     case OPTICAL_FLOW_VISUALIZATION_BLOCKS:
-      result = visualize_optical_flow_blocks(flowx, flowy);
+      result = visualize_optical_flow_blocks(samples);
       break;
     case OPTICAL_FLOW_VISUALIZATION_FACES:
-      result = visualize_optical_flow_faces(flowx, flowy);
+      result = visualize_optical_flow_faces(samples);
       break;
     default:
       assert(false);
@@ -331,6 +404,12 @@ void OpticalFlow::operator()()
 
   double total_time_ms = ((double) cv::getTickCount() - ul_start) / cv::getTickFrequency() * 1000;
 
+  mUploadLatency.observe(ul_time_ms / 1000);
+  mCalcLatency.observe(calc_time / 1000);
+  mDownloadLatency.observe(dl_time / 1000);
+  mVisualizeLatency.observe(visualize_time_ms / 1000);
+  mLatency.observe(total_time_ms / 1000);
+
   {
     cv::Point pos(50, 50);
 
@@ -349,13 +428,67 @@ void OpticalFlow::operator()()
   mVisualizationImage->update(result);
 }
 
-void OpticalFlow::setFaces(Faces *faces)
+template <typename TFlow>
+TFlow &OpticalFlow<TFlow>::backend()
+{
+  return mFlow;
+}
+
+template <typename TFlow>
+void OpticalFlow<TFlow>::setFaces(Faces *faces)
 {
   mFaces = faces;
 }
 
-void OpticalFlow::toggle_visualization()
+template <typename TFlow>
+void OpticalFlow<TFlow>::setSparse(bool sparse)
+{
+  mSparseRequested = sparse;
+}
+
+template <typename TFlow>
+void OpticalFlow<TFlow>::toggle_mode()
+{
+  // only the ui toggles the mode, the stage never writes the request
+  bool const sparse = !mSparseRequested;
+  mSparseRequested = sparse;
+  std::cout << "Optical Flow Mode: " << (sparse ? "Sparse" : "Dense") << std::endl;
+}
+
+template <typename TFlow>
+void OpticalFlow<TFlow>::setAnalysisScale(double scale)
+{
+  mScale = std::min(std::max(scale, 0.05), 1.0);
+
+  // the frames loaded so far have the old size, start over with the next one
+  mLastGray = cv::Mat();
+  mNowGray = cv::Mat();
+  mNowSeq = 0;
+  mLastPyramid.clear();
+  mNowPyramid.clear();
+  mFlowStale = true;
+}
+
+template <typename TFlow>
+void OpticalFlow<TFlow>::setFlowParams(FarnebackParams const &params)
+{
+  mFlow.setParams(params);
+}
+
+template <typename TFlow>
+void OpticalFlow<TFlow>::setSampleStride(int stride)
+{
+  mSampleStride = std::max(stride, 1);
+}
+
+template <typename TFlow>
+void OpticalFlow<TFlow>::toggle_visualization()
 {
   mVisualization = (VisualizationType)((mVisualization + 1) % OPTICAL_FLOW_VISUALIZATION_LAST_ENTRY);
   std::cout << "Optical Flow Visualization: " << mVisualizationNames[mVisualization] << std::endl;
 }
+
+template class OpticalFlow<CpuFarnebackFlow>;
+#ifdef WITH_CUDA
+template class OpticalFlow<CudaFarnebackFlow>;
+#endif
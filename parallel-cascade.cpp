@@ -0,0 +1,123 @@
+#include "parallel-cascade.h"
+
+#include <future>
+
+namespace {
+
+// grouping eps used by detectMultiScale
+double const GROUP_EPS = 0.2;
+
+}
+
+ParallelCascade::ParallelCascade(std::string const &face_cascade, int threads)
+  : mPool(std::max(threads, 1))
+{
+  for (int i = 0; i < mPool.size(); i++) {
+    mCascades.emplace_back(new cv::CascadeClassifier(face_cascade));
+  }
+}
+
+bool ParallelCascade::empty() const
+{
+  for (auto const &cascade : mCascades) {
+    if (cascade->empty()) {
+      return true;
+    }
+  }
+  return mCascades.empty();
+}
+
+int ParallelCascade::threads() const
+{
+  return mPool.size();
+}
+
+std::vector<ParallelCascade::Band> ParallelCascade::split_scales(cv::Size const &image,
+                                                                 double scale_factor,
+                                                                 cv::Size const &min_size,
+                                                                 cv::Size const &max_size) const
+{
+  cv::Size const original = mCascades[0]->getOriginalWindowSize();
+  cv::Size const max_object = (max_size.area() > 0) ? max_size : image;
+
+  // the scales detectMultiScale searches, with the number of windows it evaluates at each
+  std::vector<cv::Size> windows;
+  std::vector<double> costs;
+  double total = 0;
+  for (double factor = 1; ; factor *= scale_factor) {
+    cv::Size const window(cvRound(original.width * factor), cvRound(original.height * factor));
+    if ((window.width > max_object.width) || (window.height > max_object.height) ||
+        (window.width > image.width) || (window.height > image.height)) {
+      break;
+    }
+    if ((window.width < min_size.width) || (window.height < min_size.height)) {
+      continue;
+    }
+
+    // small scales are searched at every second pixel
+    double const step = (factor > 2) ? 1 : 2;
+    double const cost = (image.width / factor) * (image.height / factor) / (step * step);
+    windows.push_back(window);
+    costs.push_back(cost);
+    total += cost;
+  }
+
+  std::vector<Band> bands;
+  size_t const n_bands = std::min<size_t>(mCascades.size(), windows.size());
+  if (n_bands <= 1) {
+    Band all = { min_size, max_size };
+    bands.push_back(all);
+    return bands;
+  }
+
+  // window sizes grow with every scale, bands are cut between two neighbouring windows.
+  // both limits are inclusive, so neighbouring scales that round to the same window
+  // must stay in the same band, their candidates would be counted twice otherwise
+  double accumulated = 0;
+  size_t first = 0;
+  for (size_t i = 0; i < windows.size(); i++) {
+    accumulated += costs[i];
+    bool const last_window = (i + 1 == windows.size());
+    bool const full = accumulated >= total * (bands.size() + 1) / n_bands;
+    bool const can_cut = !last_window && (windows[i + 1] != windows[i]);
+    if (last_window || (full && can_cut && (bands.size() + 1 < n_bands))) {
+      // the outer bands keep the limits of the caller, so no scale is lost to rounding
+      Band band = { (first == 0) ? min_size : windows[first],
+                    last_window ? max_size : windows[i] };
+      bands.push_back(band);
+      first = i + 1;
+    }
+  }
+
+  return bands;
+}
+
+void ParallelCascade::detectMultiScale(cv::Mat const &image, std::vector<cv::Rect> &objects,
+                                       double scale_factor, int min_neighbours,
+                                       cv::Size const &min_size, cv::Size const &max_size)
+{
+  std::vector<Band> const bands = split_scales(image.size(), scale_factor, min_size, max_size);
+
+  std::vector<std::vector<cv::Rect>> candidates(bands.size());
+  std::vector<std::future<void>> done;
+  for (size_t i = 0; i < bands.size(); i++) {
+    cv::CascadeClassifier *cascade = mCascades[i].get();
+    std::vector<cv::Rect> *band_candidates = &candidates[i];
+    Band const band = bands[i];
+    double const factor = scale_factor;
+    done.push_back(mPool.submit([cascade, band_candidates, band, factor, &image]()
+                                {
+                                  // no neighbours required: all candidates, grouped below
+                                  cascade->detectMultiScale(image, *band_candidates, factor, 0, 0,
+                                                            band.min_size, band.max_size);
+                                }));
+  }
+
+  objects.clear();
+  for (size_t i = 0; i < bands.size(); i++) {
+    done[i].get();
+    objects.insert(objects.end(), candidates[i].begin(), candidates[i].end());
+  }
+
+  cv::groupRectangles(objects, min_neighbours, GROUP_EPS);
+}
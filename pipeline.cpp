@@ -0,0 +1,204 @@
+#include "pipeline.h"
+
+#include <algorithm>
+#include <cassert>
+
+Pipeline::Pipeline(int threads, int max_in_flight)
+  : mMaxInFlight(std::max(max_in_flight, 1)), mInFlight(0), mPool(new WorkStealingPool(threads))
+{
+}
+
+Pipeline::~Pipeline()
+{
+  drain();
+  mPool.reset();
+}
+
+int Pipeline::addStage(std::string const &name, std::vector<int> const &inputs, Policy policy,
+                       StageFunction function)
+{
+  // the graph can not change while frames are in flight
+  assert(!mStarted);
+
+  int const id = mStages.size();
+  std::unique_ptr<Stage> stage(new Stage());
+  stage->name = name;
+  stage->policy = policy;
+  stage->function = function;
+  stage->inputs = inputs;
+  stage->enabled = true;
+  stage->skips = &Metrics::instance().counter("tdot_pipeline_stage_skips_total",
+                                              "Frames a stage skipped because it was still busy",
+                                              "stage=\"" + name + "\"");
+
+  for (int input : inputs) {
+    assert((input >= 0) && (input < id));
+    mStages[input]->dependents.push_back(id);
+  }
+
+  mStages.push_back(std::move(stage));
+  return id;
+}
+
+void Pipeline::setEnabled(int stage, bool enabled)
+{
+  mStages[stage]->enabled = enabled;
+}
+
+bool Pipeline::isEnabled(int stage) const
+{
+  return mStages[stage]->enabled;
+}
+
+RateCounter const &Pipeline::rate(int stage) const
+{
+  return mStages[stage]->rate;
+}
+
+bool Pipeline::submit(FramePtr const &frame)
+{
+  mStarted = true;
+
+  if (mInFlight >= mMaxInFlight) {
+    mDropped.inc();
+    return false;
+  }
+  mInFlight++;
+  mInFlightGauge.set(mInFlight);
+
+  size_t const n = mStages.size();
+  std::shared_ptr<Job> job = std::make_shared<Job>();
+  job->index = mNextJob++;
+  job->frame = frame;
+  job->pending.reset(new std::atomic<int>[n]);
+  job->input_skipped.reset(new std::atomic<bool>[n]);
+  job->remaining = n;
+  for (size_t i = 0; i < n; i++) {
+    job->pending[i] = mStages[i]->inputs.size();
+    job->input_skipped[i] = false;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    if (mStages[i]->inputs.empty()) {
+      ready(job, i);
+    }
+  }
+  return true;
+}
+
+void Pipeline::drain()
+{
+  std::unique_lock<std::mutex> l(mDoneMutex);
+  mDone.wait(l, [this]() { return mInFlight == 0; });
+}
+
+void Pipeline::ready(std::shared_ptr<Job> const &job, int s)
+{
+  Stage &stage = *mStages[s];
+  bool const skip = job->input_skipped[s] || !stage.enabled;
+
+  switch (stage.policy) {
+    case CONCURRENT:
+      if (skip) {
+        finish(job, s, true);
+      } else {
+        mPool->submit([this, job, s]() { run(job, s, false); });
+      }
+      break;
+
+    case SERIAL:
+      {
+        std::unique_lock<std::mutex> l(stage.mutex);
+        stage.waiting[job->index] = std::make_pair(job, skip);
+      }
+      dispatch_serial(s);
+      break;
+
+    case LATEST:
+      if (skip) {
+        finish(job, s, true);
+        break;
+      }
+      {
+        std::unique_lock<std::mutex> l(stage.mutex);
+        // frames can arrive out of order behind concurrent stages, never go back in time
+        if (stage.running || (job->index < stage.newest)) {
+          l.unlock();
+          stage.skips->inc();
+          finish(job, s, true);
+          break;
+        }
+        stage.running = true;
+        stage.newest = job->index;
+      }
+      mPool->submit([this, job, s]() { run(job, s, false); });
+      break;
+  }
+}
+
+void Pipeline::dispatch_serial(int s)
+{
+  Stage &stage = *mStages[s];
+
+  std::shared_ptr<Job> job;
+  bool skip;
+  {
+    std::unique_lock<std::mutex> l(stage.mutex);
+    if (stage.running || stage.waiting.empty() || (stage.waiting.begin()->first != stage.next)) {
+      return;
+    }
+    job = stage.waiting.begin()->second.first;
+    skip = stage.waiting.begin()->second.second;
+    stage.waiting.erase(stage.waiting.begin());
+    stage.running = true;
+  }
+
+  if (skip) {
+    run(job, s, true);
+  } else {
+    mPool->submit([this, job, s]() { run(job, s, false); });
+  }
+}
+
+void Pipeline::run(std::shared_ptr<Job> const &job, int s, bool skip)
+{
+  Stage &stage = *mStages[s];
+
+  if (!skip) {
+    stage.function(job->frame);
+    stage.rate.tick();
+  }
+
+  if (stage.policy != CONCURRENT) {
+    std::unique_lock<std::mutex> l(stage.mutex);
+    stage.running = false;
+    stage.next++;
+  }
+
+  finish(job, s, skip);
+
+  if (stage.policy == SERIAL) {
+    dispatch_serial(s);
+  }
+}
+
+void Pipeline::finish(std::shared_ptr<Job> const &job, int s, bool skipped)
+{
+  for (int d : mStages[s]->dependents) {
+    if (skipped) {
+      job->input_skipped[d] = true;
+    }
+    if (--job->pending[d] == 0) {
+      ready(job, d);
+    }
+  }
+
+  if (--job->remaining == 0) {
+    {
+      std::unique_lock<std::mutex> l(mDoneMutex);
+      mInFlight--;
+    }
+    mInFlightGauge.set(mInFlight);
+    mDone.notify_all();
+  }
+}
@@ -0,0 +1,197 @@
+#include "quality-controller.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <utility>
+
+int const QualityController::RAISE_WINDOWS;
+int const QualityController::MAX_RAISE_WINDOWS;
+
+QualityController::QualityController(double budget_ms)
+  : mBudget(budget_ms), mRaiseWindows(RAISE_WINDOWS),
+    mStart(cv::getTickCount()), mLastUpdate(mStart)
+{
+}
+
+QualityController::Stage &QualityController::stage(std::string const &name)
+{
+  for (Stage &stage : mStages) {
+    if (stage.name == name) {
+      return stage;
+    }
+  }
+
+  Stage stage;
+  stage.name = name;
+  stage.latency = &stage_latency(name);
+  stage.last_count = stage.latency->count();
+  stage.last_sum = stage.latency->sum();
+  mStages.push_back(stage);
+  return mStages.back();
+}
+
+void QualityController::addKnob(std::string const &stage_name, std::string const &name,
+                                std::vector<double> const &values, Setter setter)
+{
+  if (values.empty()) {
+    std::cerr << "quality knob " << name << " has no values" << std::endl;
+    return;
+  }
+
+  stage(stage_name);
+
+  std::unique_ptr<Knob> knob(new Knob());
+  knob->stage = stage_name;
+  knob->name = name;
+  knob->values = values;
+  knob->setter = setter;
+  knob->level = 0;
+  knob->gauge = &Metrics::instance().gauge("tdot_quality_level",
+                                           "Setting of a quality knob, 0 is the best quality",
+                                           "knob=\"" + stage_name + "_" + name + "\"");
+  mKnobs.push_back(std::move(knob));
+}
+
+bool QualityController::setLogFile(std::string const &file)
+{
+  std::lock_guard<std::mutex> l(mDecisionMutex);
+  mLogFile.open(file, std::ios::out | std::ios::app);
+  if (!mLogFile) {
+    std::cerr << "opening quality log " << file << " failed" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void QualityController::change(Knob &knob, int level, double latency_ms)
+{
+  Decision decision;
+  decision.time_s = (cv::getTickCount() - mStart) / cv::getTickFrequency();
+  decision.stage = knob.stage;
+  decision.knob = knob.name;
+  decision.latency_ms = latency_ms;
+  decision.from = knob.values[knob.level];
+  decision.to = knob.values[level];
+
+  bool const lower = level > knob.level;
+  (lower ? mLowers : mRaises).inc();
+  knob.level = level;
+  knob.gauge->set(level);
+
+  std::ostringstream line;
+  line << std::fixed << std::setprecision(1) << decision.time_s << "s ";
+  line.unsetf(std::ios::floatfield);
+  line << std::setprecision(4)
+       << (lower ? "lower " : "raise ") << knob.stage << "." << knob.name << " "
+       << decision.from << " -> " << decision.to
+       << " (" << (lower ? knob.stage : "slowest stage") << " "
+       << latency_ms << "ms, budget " << mBudget << "ms)";
+
+  std::lock_guard<std::mutex> l(mDecisionMutex);
+  mDecisions.push_back(decision);
+  std::cout << "quality: " << line.str() << std::endl;
+  if (mLogFile.is_open()) {
+    mLogFile << line.str() << std::endl;
+  }
+}
+
+void QualityController::update()
+{
+  int64_t const now = cv::getTickCount();
+  if ((now - mLastUpdate) / cv::getTickFrequency() < WINDOW) {
+    return;
+  }
+  mLastUpdate = now;
+
+  // mean latency of every stage that ran in this window, slowest first
+  std::vector<std::pair<double, std::string>> latencies;
+  for (Stage &stage : mStages) {
+    uint64_t const count = stage.latency->count();
+    double const sum = stage.latency->sum();
+    uint64_t const runs = count - stage.last_count;
+    double const seconds = sum - stage.last_sum;
+    stage.last_count = count;
+    stage.last_sum = sum;
+
+    if (runs >= MIN_SAMPLES) {
+      latencies.push_back(std::make_pair(seconds / runs * 1000, stage.name));
+    }
+  }
+  std::sort(latencies.rbegin(), latencies.rend());
+
+  // the window after a change still ran partly with the old settings
+  if (mSettleWindows > 0) {
+    mSettleWindows--;
+    return;
+  }
+  if (latencies.empty()) {
+    return;
+  }
+
+  for (auto const &latency : latencies) {
+    if (latency.first <= mBudget) {
+      break;
+    }
+
+    for (size_t i = 0; i < mKnobs.size(); i++) {
+      Knob &knob = *mKnobs[i];
+      if ((knob.stage != latency.second) || (knob.level + 1 >= (int) knob.values.size())) {
+        continue;
+      }
+
+      // the last raise did not fit into the budget, wait longer before trying again
+      if ((int) i == mLastRaised) {
+        mRaiseWindows = std::min(mRaiseWindows * 2, MAX_RAISE_WINDOWS);
+      }
+      mLastRaised = -1;
+
+      change(knob, knob.level + 1, latency.first);
+      mLowered.push_back(i);
+      mHeadroomWindows = 0;
+      mSettleWindows = 1;
+      return;
+    }
+  }
+
+  if (latencies.front().first > mBudget * HEADROOM) {
+    mHeadroomWindows = 0;
+    return;
+  }
+
+  if (mLowered.empty() || (++mHeadroomWindows < mRaiseWindows)) {
+    return;
+  }
+
+  int const i = mLowered.back();
+  mLowered.pop_back();
+  change(*mKnobs[i], mKnobs[i]->level - 1, latencies.front().first);
+  mLastRaised = i;
+  mHeadroomWindows = 0;
+  mSettleWindows = 1;
+  if (mLowered.empty()) {
+    mRaiseWindows = RAISE_WINDOWS;
+  }
+}
+
+void QualityController::apply(std::string const &stage)
+{
+  for (std::unique_ptr<Knob> &knob : mKnobs) {
+    if (knob->stage != stage) {
+      continue;
+    }
+
+    int const level = knob->level;
+    if (level != knob->applied) {
+      knob->applied = level;
+      knob->setter(knob->values[level]);
+    }
+  }
+}
+
+std::vector<QualityController::Decision> QualityController::decisions() const
+{
+  std::lock_guard<std::mutex> l(mDecisionMutex);
+  return mDecisions;
+}
@@ -0,0 +1,133 @@
+#include "recorder.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include "opencv2/imgproc.hpp"
+
+Recorder::Recorder(std::string const &name, size_t queue_size, Policy policy)
+  : mName(name), mQueueSize(std::max<size_t>(queue_size, 1)), mPolicy(policy),
+    mWritten(Metrics::instance().counter("tdot_recorder_frames_written_total",
+                                         "Frames encoded into a recording",
+                                         "stream=\"" + name + "\"")),
+    mDropped(Metrics::instance().counter("tdot_recorder_frames_dropped_total",
+                                         "Frames not recorded because the encoder queue was full",
+                                         "stream=\"" + name + "\""))
+{
+}
+
+Recorder::~Recorder()
+{
+  stop();
+}
+
+bool Recorder::start(std::string const &file, double fps, cv::Size const &size, bool color,
+                     std::string const &fourcc)
+{
+  stop();
+
+  if (fourcc.size() != 4) {
+    std::cerr << "invalid fourcc " << fourcc << " for " << file << std::endl;
+    return false;
+  }
+
+  int const code = cv::VideoWriter::fourcc(fourcc[0], fourcc[1], fourcc[2], fourcc[3]);
+  if (!mWriter.open(file, code, fps, size, color)) {
+    std::cerr << "opening " << file << " for recording the " << mName << " view failed" << std::endl;
+    return false;
+  }
+  mSize = size;
+
+  {
+    std::lock_guard<std::mutex> l(mMutex);
+    mStop = false;
+  }
+  mThread = std::thread(&Recorder::encode_loop, this);
+  return true;
+}
+
+void Recorder::stop()
+{
+  {
+    std::lock_guard<std::mutex> l(mMutex);
+    mStop = true;
+  }
+  mQueued.notify_all();
+  mTaken.notify_all();
+
+  if (mThread.joinable()) {
+    mThread.join();
+  }
+  mWriter.release();
+}
+
+bool Recorder::isRecording() const
+{
+  std::lock_guard<std::mutex> l(mMutex);
+  return !mStop;
+}
+
+bool Recorder::write(cv::Mat const &image)
+{
+  if (image.empty()) {
+    return false;
+  }
+
+  std::unique_lock<std::mutex> l(mMutex);
+  if (mPolicy == BLOCK) {
+    mTaken.wait(l, [this]() { return mStop || (mQueue.size() < mQueueSize); });
+  }
+
+  if (mStop) {
+    return false;
+  }
+  if (mQueue.size() >= mQueueSize) {
+    l.unlock();
+    mDropped.inc();
+    return false;
+  }
+
+  // the image is read only, queue a reference instead of a copy
+  mQueue.push_back(image);
+  l.unlock();
+  mQueued.notify_one();
+  return true;
+}
+
+void Recorder::encode_loop()
+{
+  cv::Mat resized;
+
+  for (;;) {
+    cv::Mat image;
+    {
+      std::unique_lock<std::mutex> l(mMutex);
+      mQueued.wait(l, [this]() { return mStop || !mQueue.empty(); });
+      // the queued images are still written when stopping
+      if (mQueue.empty()) {
+        return;
+      }
+      image = mQueue.front();
+      mQueue.pop_front();
+    }
+    mTaken.notify_one();
+
+    // the writer only takes images of the size it was opened with
+    if (image.size() != mSize) {
+      cv::resize(image, resized, mSize);
+      image = resized;
+    }
+    mWriter.write(image);
+    mWritten.inc();
+  }
+}
+
+uint64_t Recorder::written() const
+{
+  return mWritten.value();
+}
+
+uint64_t Recorder::dropped() const
+{
+  return mDropped.value();
+}
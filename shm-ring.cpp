@@ -0,0 +1,246 @@
+#include "shm-ring.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// the atomics are shared between processes, which only works if they do not need a lock
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "64 bit atomics are not lock free");
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "32 bit atomics are not lock free");
+
+namespace {
+
+size_t const ALIGNMENT = 64;
+
+size_t align(size_t size, size_t alignment)
+{
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+size_t slots_offset()
+{
+  return align(sizeof(ShmRingHeader), ALIGNMENT);
+}
+
+}
+
+ShmRingWriter::~ShmRingWriter()
+{
+  close();
+}
+
+bool ShmRingWriter::create(std::string const &name, int slots, size_t pixel_bytes)
+{
+  close();
+
+  if (slots < 2) {
+    std::cerr << "a frame ring needs at least 2 slots" << std::endl;
+    return false;
+  }
+
+  size_t const pixel_offset = align(sizeof(ShmSlot), ALIGNMENT);
+  size_t const slot_bytes = align(pixel_offset + pixel_bytes, sysconf(_SC_PAGESIZE));
+  size_t const size = slots_offset() + slot_bytes * slots;
+
+  // readers of an old ring keep their mapping, they notice the new one through closed()
+  shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0) {
+    std::cerr << "could not create shared memory " << name << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  if (ftruncate(fd, size) < 0) {
+    std::cerr << "could not size shared memory " << name << ": " << strerror(errno) << std::endl;
+    ::close(fd);
+    shm_unlink(name.c_str());
+    return false;
+  }
+
+  void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (memory == MAP_FAILED) {
+    std::cerr << "could not map shared memory " << name << ": " << strerror(errno) << std::endl;
+    shm_unlink(name.c_str());
+    return false;
+  }
+
+  // ftruncate zeroed the memory, i.e. every slot is empty
+  mName = name;
+  mSize = size;
+  mHeader = static_cast<ShmRingHeader *>(memory);
+  mHeader->layout = SHM_RING_LAYOUT;
+  mHeader->slots = slots;
+  mHeader->pixel_offset = pixel_offset;
+  mHeader->slot_bytes = slot_bytes;
+  mHeader->pixel_bytes = pixel_bytes;
+  mHeader->latest.store(0, std::memory_order_relaxed);
+  mHeader->magic.store(SHM_RING_MAGIC, std::memory_order_release);
+
+  std::cout << "exporting frames to shared memory " << name << ", " << slots << " slots of "
+            << slot_bytes / 1024 << " KB" << std::endl;
+  return true;
+}
+
+void ShmRingWriter::close()
+{
+  if (mHeader == nullptr) {
+    return;
+  }
+
+  mHeader->magic.store(0, std::memory_order_release);
+  munmap(mHeader, mSize);
+  shm_unlink(mName.c_str());
+  mHeader = nullptr;
+  mSize = 0;
+}
+
+ShmSlot *ShmRingWriter::slot(uint64_t seq) const
+{
+  uint8_t *slots = reinterpret_cast<uint8_t *>(mHeader) + slots_offset();
+  return reinterpret_cast<ShmSlot *>(slots + (seq % mHeader->slots) * mHeader->slot_bytes);
+}
+
+bool ShmRingWriter::write(ShmFrameInfo const &info, void const *pixels, size_t row_bytes, size_t step)
+{
+  if ((mHeader == nullptr) || (info.seq == 0) || (row_bytes * info.height > mHeader->pixel_bytes)) {
+    return false;
+  }
+
+  // a seqlock: readers that see 0, or a different seq after reading, throw away what they read
+  ShmSlot *s = slot(info.seq);
+  s->seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  s->info = info;
+  s->info.step = row_bytes;
+  s->info.num_faces = std::min(std::max(info.num_faces, 0), SHM_MAX_FACES);
+
+  uint8_t *dst = reinterpret_cast<uint8_t *>(s) + mHeader->pixel_offset;
+  uint8_t const *src = static_cast<uint8_t const *>(pixels);
+  if (row_bytes == step) {
+    memcpy(dst, src, row_bytes * info.height);
+  } else {
+    for (int y = 0; y < info.height; y++) {
+      memcpy(dst + y * row_bytes, src + y * step, row_bytes);
+    }
+  }
+
+  s->seq.store(info.seq, std::memory_order_release);
+  mHeader->latest.store(info.seq, std::memory_order_release);
+  return true;
+}
+
+ShmRingReader::~ShmRingReader()
+{
+  close();
+}
+
+bool ShmRingReader::open(std::string const &name)
+{
+  close();
+
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    std::cerr << "could not open shared memory " << name << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  struct stat st;
+  if ((fstat(fd, &st) < 0) || ((size_t) st.st_size < sizeof(ShmRingHeader))) {
+    std::cerr << "shared memory " << name << " is no frame ring" << std::endl;
+    ::close(fd);
+    return false;
+  }
+
+  void *memory = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (memory == MAP_FAILED) {
+    std::cerr << "could not map shared memory " << name << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  ShmRingHeader const *header = static_cast<ShmRingHeader const *>(memory);
+  if ((header->magic.load(std::memory_order_acquire) != (uint32_t) SHM_RING_MAGIC) ||
+      (header->layout != (uint32_t) SHM_RING_LAYOUT) ||
+      (slots_offset() + header->slot_bytes * header->slots > (size_t) st.st_size)) {
+    std::cerr << "shared memory " << name << " is no frame ring of this version" << std::endl;
+    munmap(memory, st.st_size);
+    return false;
+  }
+
+  mHeader = header;
+  mSize = st.st_size;
+  return true;
+}
+
+void ShmRingReader::close()
+{
+  if (mHeader == nullptr) {
+    return;
+  }
+
+  munmap(const_cast<ShmRingHeader *>(mHeader), mSize);
+  mHeader = nullptr;
+  mSize = 0;
+}
+
+bool ShmRingReader::closed() const
+{
+  return (mHeader == nullptr) || (mHeader->magic.load(std::memory_order_acquire) != (uint32_t) SHM_RING_MAGIC);
+}
+
+ShmSlot const *ShmRingReader::slot(uint64_t seq) const
+{
+  uint8_t const *slots = reinterpret_cast<uint8_t const *>(mHeader) + slots_offset();
+  return reinterpret_cast<ShmSlot const *>(slots + (seq % mHeader->slots) * mHeader->slot_bytes);
+}
+
+uint64_t ShmRingReader::latestSeq() const
+{
+  if (mHeader == nullptr) {
+    return 0;
+  }
+  return mHeader->latest.load(std::memory_order_acquire);
+}
+
+bool ShmRingReader::latest(ShmFrameView &view) const
+{
+  // the latest slot is only overwritten after all others, so a retry rarely fails again
+  for (int attempt = 0; attempt < 3; attempt++) {
+    uint64_t const seq = latestSeq();
+    if (seq == 0) {
+      return false;
+    }
+
+    ShmSlot const *s = slot(seq);
+    if (s->seq.load(std::memory_order_acquire) != seq) {
+      continue;
+    }
+
+    view.info = s->info;
+    view.info.seq = seq;
+    view.pixels = reinterpret_cast<uint8_t const *>(s) + mHeader->pixel_offset;
+    if (valid(view)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool ShmRingReader::valid(ShmFrameView const &view) const
+{
+  if ((mHeader == nullptr) || (view.info.seq == 0)) {
+    return false;
+  }
+
+  // orders the reads of the slot before the check of its seq
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return slot(view.info.seq)->seq.load(std::memory_order_relaxed) == view.info.seq;
+}
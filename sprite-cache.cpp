@@ -0,0 +1,81 @@
+#include "sprite-cache.h"
+
+SpriteCache::SpriteCache(size_t budget_bytes)
+                        : mBudget(budget_bytes), mHits(0), mMisses(0), mEvictions(0)
+{
+}
+
+size_t SpriteCache::bytes(Sprite const &sprite)
+{
+  return sprite.color.total() * sprite.color.elemSize()
+       + sprite.alpha.total() * sprite.alpha.elemSize();
+}
+
+void SpriteCache::evict()
+{
+  while ((mBytes > mBudget) && !mEntries.empty()) {
+    Entry const &oldest = mEntries.back();
+    mBytes -= bytes(oldest.second);
+    mIndex.erase(oldest.first);
+    mEntries.pop_back();
+    mEvictions++;
+    mEvictionsTotal.inc();
+  }
+}
+
+bool SpriteCache::get(int key, Sprite &sprite)
+{
+  std::unique_lock<std::mutex> l(mMutex);
+
+  auto it = mIndex.find(key);
+  if (it == mIndex.end()) {
+    mMisses++;
+    mMissesTotal.inc();
+    return false;
+  }
+
+  // move to the front of the list
+  mEntries.splice(mEntries.begin(), mEntries, it->second);
+  sprite = it->second->second;
+  mHits++;
+  mHitsTotal.inc();
+  return true;
+}
+
+void SpriteCache::put(int key, Sprite const &sprite)
+{
+  std::unique_lock<std::mutex> l(mMutex);
+
+  auto it = mIndex.find(key);
+  if (it != mIndex.end()) {
+    mBytes -= bytes(it->second->second);
+    mEntries.erase(it->second);
+    mIndex.erase(it);
+  }
+
+  mEntries.emplace_front(key, sprite);
+  mIndex[key] = mEntries.begin();
+  mBytes += bytes(sprite);
+
+  evict();
+}
+
+void SpriteCache::setBudget(size_t budget_bytes)
+{
+  std::unique_lock<std::mutex> l(mMutex);
+  mBudget = budget_bytes;
+  evict();
+}
+
+SpriteCacheStats SpriteCache::stats() const
+{
+  std::unique_lock<std::mutex> l(mMutex);
+
+  SpriteCacheStats stats;
+  stats.hits = mHits;
+  stats.misses = mMisses;
+  stats.evictions = mEvictions;
+  stats.entries = mEntries.size();
+  stats.bytes = mBytes;
+  return stats;
+}
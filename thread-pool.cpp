@@ -0,0 +1,66 @@
+#include "thread-pool.h"
+
+#include <algorithm>
+#include <memory>
+
+ThreadPool::ThreadPool(int threads)
+{
+  if (threads <= 0) {
+    threads = std::max<int>(std::thread::hardware_concurrency(), 1);
+  }
+
+  for (int i = 0; i < threads; i++) {
+    mThreads.emplace_back(&ThreadPool::worker, this);
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::unique_lock<std::mutex> l(mMutex);
+    mStop = true;
+  }
+  mEvent.notify_all();
+
+  for (auto &t : mThreads) {
+    t.join();
+  }
+}
+
+int ThreadPool::size() const
+{
+  return mThreads.size();
+}
+
+std::future<void> ThreadPool::submit(std::function<void()> task)
+{
+  // std::function needs a copyable target
+  auto packaged = std::make_shared<std::packaged_task<void()>>(task);
+  std::future<void> done = packaged->get_future();
+
+  {
+    std::unique_lock<std::mutex> l(mMutex);
+    mTasks.emplace_back([packaged]() { (*packaged)(); });
+  }
+  mEvent.notify_one();
+
+  return done;
+}
+
+void ThreadPool::worker()
+{
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> l(mMutex);
+      mEvent.wait(l, [this]() { return mStop || !mTasks.empty(); });
+      // remaining tasks are still run, somebody may wait for them
+      if (mTasks.empty()) {
+        return;
+      }
+      task = std::move(mTasks.front());
+      mTasks.pop_front();
+    }
+    task();
+  }
+}
@@ -1,23 +1,40 @@
 #include "thread-safe-mat.h"
 
-ThreadSafeMat::ThreadSafeMat()
+ThreadSafeMat::ThreadSafeMat() : ThreadSafeMat(cv::Mat())
 {
 }
 
-ThreadSafeMat::ThreadSafeMat(cv::Mat mat)
+ThreadSafeMat::ThreadSafeMat(cv::Mat mat) : mVersion(0)
 {
-  mat.copyTo(mMat);
+  std::shared_ptr<Published> published = std::make_shared<Published>();
+  published->mat = mat;
+  published->version = 0;
+  mPublished = published;
 }
 
-cv::Mat ThreadSafeMat::get()
+cv::Mat ThreadSafeMat::get() const
 {
-  std::unique_lock<std::mutex> l(mMutex);
-  cv::Mat ret;
-  mMat.copyTo(ret);
-  return ret;
+  uint64_t version;
+  return get(version);
 }
+
+cv::Mat ThreadSafeMat::get(uint64_t &version) const
+{
+  std::shared_ptr<Published const> published = std::atomic_load(&mPublished);
+  version = published->version;
+  // a new header on the shared pixels, they stay alive as long as the caller holds it
+  return published->mat;
+}
+
+uint64_t ThreadSafeMat::version() const
+{
+  return std::atomic_load(&mPublished)->version;
+}
+
 void ThreadSafeMat::update(cv::Mat new_mat)
 {
-  std::unique_lock<std::mutex> l(mMutex);
-  new_mat.copyTo(mMat);
+  std::shared_ptr<Published> published = std::make_shared<Published>();
+  published->mat = new_mat;
+  published->version = mVersion.fetch_add(1) + 1;
+  std::atomic_store(&mPublished, std::shared_ptr<Published const>(published));
 }
@@ -0,0 +1,114 @@
+#include "work-stealing-pool.h"
+
+#include <algorithm>
+
+namespace {
+
+// index of the pool worker running on this thread, or -1
+thread_local int current_worker = -1;
+thread_local WorkStealingPool const *current_pool = nullptr;
+
+}
+
+WorkStealingPool::WorkStealingPool(int threads) : mNextQueue(0), mQueued(0)
+{
+  if (threads <= 0) {
+    threads = std::max<int>(std::thread::hardware_concurrency(), 1);
+  }
+
+  for (int i = 0; i < threads; i++) {
+    mQueues.emplace_back(new Queue());
+  }
+  for (int i = 0; i < threads; i++) {
+    mThreads.emplace_back(&WorkStealingPool::worker, this, i);
+  }
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+  {
+    std::unique_lock<std::mutex> l(mIdleMutex);
+    mStop = true;
+  }
+  mIdle.notify_all();
+
+  for (auto &t : mThreads) {
+    t.join();
+  }
+}
+
+int WorkStealingPool::size() const
+{
+  return mThreads.size();
+}
+
+void WorkStealingPool::submit(std::function<void()> task)
+{
+  size_t queue;
+  if ((current_pool == this) && (current_worker >= 0)) {
+    queue = current_worker;
+  } else {
+    queue = mNextQueue.fetch_add(1, std::memory_order_relaxed) % mQueues.size();
+  }
+
+  {
+    std::unique_lock<std::mutex> l(mQueues[queue]->mutex);
+    mQueues[queue]->tasks.push_back(std::move(task));
+  }
+
+  // counted under the idle lock, so a worker can not miss it between checking and sleeping
+  {
+    std::unique_lock<std::mutex> l(mIdleMutex);
+    mQueued++;
+  }
+  mIdle.notify_one();
+}
+
+bool WorkStealingPool::pop(size_t queue, std::function<void()> &task)
+{
+  std::unique_lock<std::mutex> l(mQueues[queue]->mutex);
+  if (mQueues[queue]->tasks.empty()) {
+    return false;
+  }
+
+  task = std::move(mQueues[queue]->tasks.back());
+  mQueues[queue]->tasks.pop_back();
+  return true;
+}
+
+bool WorkStealingPool::steal(size_t thief, std::function<void()> &task)
+{
+  for (size_t i = 1; i < mQueues.size(); i++) {
+    Queue &victim = *mQueues[(thief + i) % mQueues.size()];
+
+    std::unique_lock<std::mutex> l(victim.mutex);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkStealingPool::worker(size_t index)
+{
+  current_worker = index;
+  current_pool = this;
+
+  while (true) {
+    std::function<void()> task;
+    if (pop(index, task) || steal(index, task)) {
+      mQueued--;
+      task();
+      continue;
+    }
+
+    std::unique_lock<std::mutex> l(mIdleMutex);
+    // queued tasks are still run when stopping, somebody may wait for them
+    if (mStop && (mQueued == 0)) {
+      return;
+    }
+    mIdle.wait(l, [this]() { return mStop || (mQueued > 0); });
+  }
+}